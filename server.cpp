@@ -16,11 +16,58 @@
 #include <queue>
 #include <filesystem>
 #include <ctime>
+#include <charconv>
+#include <strings.h>
+#include <list>
+#include <shared_mutex>
+#include <memory>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <memory_resource>
+#include <string_view>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <csignal>
+#include <algorithm>
+#include <sys/socket.h>
+#include <optional>
+#include <cmath>
+#include <array>
+#include <random>
+#include <arpa/inet.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <coroutine>
+#include <functional>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <map>
+#include <deque>
+#include <unordered_set>
+#include <sys/un.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 // OpenSSL Headers
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+// Compression Libraries
+#include <zlib.h>
+#include <brotli/encode.h>
 
 // JSON Parsing Library
 #include "json.hpp"
@@ -28,35 +75,522 @@ using json = nlohmann::json;
 
 namespace fs = std::filesystem;
 
-// Configuration Variables
+// Configuration value that workers read while a reload may replace it. Readers get a shared
+// reference to the value current at the time and keep it for as long as they use it; a replaced
+// value is freed once its last reader lets go. Only main() sets values.
+template <class T>
+class LiveValue {
+public:
+    LiveValue() { set(T()); }
+    std::shared_ptr<const T> get() const { return current.load(std::memory_order_acquire); }
+    void set(T value) {
+        current.store(std::make_shared<const T>(std::move(value)), std::memory_order_release);
+    }
+
+private:
+    std::atomic<std::shared_ptr<const T>> current;
+};
+
+// Configuration Variables. Those read by workers are atomic or LiveValues so that a reload
+// (SIGHUP or an edit of config.json) can change them while requests are in flight.
 int PORT;
-int MAX_THREADS;
-std::string WEB_ROOT;
+std::atomic<int> MAX_THREADS;
+std::atomic<int> MIN_THREADS;
+std::atomic<bool> ADAPTIVE_THREADS;
+std::atomic<int> ADAPTIVE_TARGET_WAIT_MS;
+LiveValue<std::string> CPU_AFFINITY;
+LiveValue<std::string> WEB_ROOT;
+std::atomic<size_t> COMPRESSION_MIN_SIZE;
+std::atomic<size_t> COMPRESSION_MAX_SIZE;
+size_t COMPRESSION_CACHE_SIZE;
+LiveValue<std::vector<std::string>> COMPRESSIBLE_TYPES;
+size_t OPEN_FILE_CACHE_SIZE;
+int OPEN_FILE_CACHE_TTL_MS;
+size_t CONTENT_CACHE_SIZE;
+std::atomic<size_t> CONTENT_CACHE_MAX_FILE_SIZE;
+bool WATCH_WEB_ROOT;
+std::atomic<bool> PRELOAD_WEB_ROOT;
+std::atomic<int> KEEPALIVE_TIMEOUT_MS;
+std::atomic<int> KEEPALIVE_MAX_REQUESTS;
+std::atomic<int> HANDSHAKE_TIMEOUT_MS;
+std::atomic<int> HEADER_TIMEOUT_MS;
+std::atomic<int> BODY_TIMEOUT_MS;
+std::atomic<int> WRITE_TIMEOUT_MS;
+size_t ACCEPT_QUEUE_SIZE;
+LiveValue<std::string> SHED_MODE;
+bool ACCEPT_QUEUE_CODEL;
+int CODEL_TARGET_MS;
+int CODEL_INTERVAL_MS;
+double RATE_LIMIT_CONNECTIONS_PER_SECOND;
+double RATE_LIMIT_CONNECTION_BURST;
+double RATE_LIMIT_REQUESTS_PER_SECOND;
+double RATE_LIMIT_REQUEST_BURST;
+int RATE_LIMIT_IPV4_PREFIX;
+int RATE_LIMIT_IPV6_PREFIX;
+size_t RATE_LIMIT_TABLE_SIZE;
+int SHUTDOWN_TIMEOUT_MS;
+bool WATCH_CONFIG;
+std::atomic<int> PROXY_CONNECT_TIMEOUT_MS;
+std::atomic<int> PROXY_READ_TIMEOUT_MS;
+std::atomic<int> HEALTH_CHECK_INTERVAL_MS;
+size_t RESPONSE_CACHE_SIZE;
+size_t RESPONSE_CACHE_MAX_ENTRY_SIZE;
+std::atomic<int> RESPONSE_CACHE_LOCK_TIMEOUT_MS;
+std::atomic<int> WEBSOCKET_PING_INTERVAL_MS;
+std::atomic<size_t> WEBSOCKET_MAX_MESSAGE_SIZE;
+std::atomic<size_t> WEBSOCKET_MAX_QUEUED_BYTES;
+std::atomic<bool> WEBSOCKET_DEFLATE;
+std::atomic<size_t> SSE_MAX_QUEUED_EVENTS;
+LiveValue<std::string> SSE_SLOW_CONSUMER_POLICY;
+std::atomic<int> SSE_HEARTBEAT_INTERVAL_MS;
+
+// Shutdown state: while draining, no connection is kept alive past its current request; once
+// the drain deadline has passed, all remaining reads and writes fail immediately
+std::atomic<bool> draining{false};
+std::atomic<bool> abort_connections{false};
+
+// Heap allocation counters of the current thread, so the allocation cost of each request can be
+// reported in /metrics. They are only fed in builds with -DCOUNT_HEAP_ALLOCATIONS, which replaces
+// the global operator new for the whole process (OpenSSL, zlib and json included); otherwise they
+// stay 0 and the request_heap_* metrics are left out.
+thread_local uint64_t thread_heap_allocations = 0;
+thread_local uint64_t thread_heap_bytes = 0;
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+// The array and nothrow forms call these, so replacing the plain and aligned ones covers them
+[[gnu::noinline]] void* operator new(std::size_t size) {
+    thread_heap_allocations++;
+    thread_heap_bytes += size;
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void* operator new(std::size_t size, std::align_val_t alignment) {
+    thread_heap_allocations++;
+    thread_heap_bytes += size;
+    size_t align = static_cast<size_t>(alignment);
+    if (void *ptr = std::aligned_alloc(align, (std::max<size_t>(size, 1) + align - 1) / align * align))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+// Kept out of line so the compiler does not pair the inlined free() with new-expressions
+[[gnu::noinline]] void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+#endif
+
+// Request Arena: per-thread bump allocator backing request-scoped buffers (raw request, parsed
+// headers, response headers, log line). Nothing is freed individually; reset() drops everything
+// at once when the request is done and the first block is kept for the next request, so a
+// typical request never reaches malloc.
+class RequestArena : public std::pmr::memory_resource {
+public:
+    static const size_t INITIAL_BLOCK = 64 * 1024;
+    RequestArena()
+        : block(new std::byte[INITIAL_BLOCK]),
+          arena(block.get(), INITIAL_BLOCK, std::pmr::new_delete_resource()) {}
+    void reset() {
+        arena.release();
+        used = 0;
+    }
+    size_t bytes_used() const { return used; }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        used += bytes;
+        return arena.allocate(bytes, alignment);
+    }
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+    std::unique_ptr<std::byte[]> block;
+    std::pmr::monotonic_buffer_resource arena;
+    size_t used = 0;
+};
+
+thread_local RequestArena request_arena;
+
+// Function to get the memory resource for allocations that live until the end of the request
+std::pmr::memory_resource* request_memory() {
+    return &request_arena;
+}
+
+// Transparent string hash so maps keyed by std::string can be probed with a string_view
+struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const { return std::hash<std::string_view>{}(key); }
+};
+
+// Parsed request: "method", "path", "version", "body" plus one entry per header, all allocated
+// from the request arena
+using RequestInfo = std::pmr::unordered_map<std::pmr::string, std::pmr::string>;
+
+// Why a connection was turned away instead of being served
+enum ShedReason { SHED_QUEUE_FULL, SHED_CODEL, SHED_REASONS };
+
+// Client address as captured at accept. IPv4 addresses are kept IPv4-mapped ("::ffff:a.b.c.d")
+// so both families share one 16-byte form. Peers on a Unix domain socket have no address.
+struct PeerAddress {
+    std::array<uint8_t, 16> ip{};
+    uint16_t port = 0;
+    bool local = false;   // connected over a Unix domain socket
+
+    static PeerAddress from(const sockaddr_storage& addr);
+    bool is_v4() const {
+        static const uint8_t mapped_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        return std::memcmp(ip.data(), mapped_prefix, sizeof(mapped_prefix)) == 0;
+    }
+    // Writes the address in text form (no port) to `out`; returns its length
+    size_t format(char *out, size_t size) const;
+};
+
+PeerAddress PeerAddress::from(const sockaddr_storage& addr) {
+    PeerAddress peer;
+    if (addr.ss_family == AF_INET) {
+        const auto& v4 = reinterpret_cast<const sockaddr_in&>(addr);
+        peer.ip[10] = peer.ip[11] = 0xff;
+        std::memcpy(&peer.ip[12], &v4.sin_addr, 4);
+        peer.port = ntohs(v4.sin_port);
+    } else if (addr.ss_family == AF_INET6) {
+        const auto& v6 = reinterpret_cast<const sockaddr_in6&>(addr);
+        std::memcpy(peer.ip.data(), &v6.sin6_addr, 16);
+        peer.port = ntohs(v6.sin6_port);
+    } else if (addr.ss_family == AF_UNIX) {
+        peer.local = true;
+    }
+    return peer;
+}
+
+size_t PeerAddress::format(char *out, size_t size) const {
+    if (local) {
+        if (size < 6)
+            return 0;
+        std::memcpy(out, "unix:", 6);
+        return 5;
+    }
+    bool v4 = is_v4();
+    if (!inet_ntop(v4 ? AF_INET : AF_INET6, v4 ? &ip[12] : ip.data(), out, size))
+        return 0;
+    return std::strlen(out);
+}
+
+// Address block such as "10.0.0.0/8" or "2001:db8::/32" (a bare address is a block of one),
+// kept in PeerAddress's IPv4-mapped form so one comparison covers both families
+struct AddressRange {
+    std::array<uint8_t, 16> ip{};
+    int prefix = 128;   // leading bits of `ip` that must match
+
+    static std::optional<AddressRange> parse(std::string_view text);
+    bool contains(const PeerAddress& peer) const;
+};
+
+std::optional<AddressRange> AddressRange::parse(std::string_view text) {
+    size_t slash = text.find('/');
+    std::string_view ip_text = text.substr(0, slash);
+    char address[INET6_ADDRSTRLEN];
+    if (ip_text.size() >= sizeof(address))
+        return std::nullopt;
+    std::memcpy(address, ip_text.data(), ip_text.size());
+    address[ip_text.size()] = '\0';
+
+    AddressRange range;
+    int max_prefix = 128;
+    if (inet_pton(AF_INET, address, &range.ip[12]) == 1) {
+        range.ip[10] = range.ip[11] = 0xff;
+        max_prefix = 32;
+    } else if (inet_pton(AF_INET6, address, range.ip.data()) != 1) {
+        return std::nullopt;
+    }
+    int prefix = max_prefix;
+    if (slash != std::string_view::npos) {
+        const char *end = text.data() + text.size();
+        auto [last, ec] = std::from_chars(text.data() + slash + 1, end, prefix);
+        if (ec != std::errc() || last != end || prefix < 0 || prefix > max_prefix)
+            return std::nullopt;
+    }
+    range.prefix = prefix + (128 - max_prefix);
+    return range;
+}
+
+bool AddressRange::contains(const PeerAddress& peer) const {
+    if (peer.local)
+        return false;
+    for (int i = 0; i < 16 && i * 8 < prefix; i++) {
+        int bits = std::min(prefix - i * 8, 8);
+        if ((peer.ip[i] ^ ip[i]) & (0xff << (8 - bits)) & 0xff)
+            return false;
+    }
+    return true;
+}
+
+// Listening socket and how the connections accepted from it are served: over TLS, as plaintext
+// HTTP (for traffic a load balancer has already decrypted), or by redirecting every request to
+// the HTTPS listener on `redirect_port`. Plaintext and redirect connections never touch OpenSSL.
+struct Listener {
+    enum Mode { TLS, PLAIN, REDIRECT };
+    static constexpr const char *MODE_NAMES[] = {"tls", "plain", "redirect"};
+
+    int fd = -1;
+    Mode mode = TLS;
+    std::string name;        // "0.0.0.0:8443", "[::]:8443" or "unix:/path"
+    std::string path;        // Unix domain socket listeners only
+    int redirect_port = 0;
+    SSL_CTX *ctx = nullptr;   // TLS listeners only
+    bool proxy_protocol = false;              // connections start with a PROXY protocol header
+    std::vector<AddressRange> proxy_trusted;  // sources allowed to send one; empty trusts all
+    bool tcp_cork = false;                    // responses written in several parts are corked
+    bool tcp_fastopen = false;                // accepted connections are checked for SYN data
+    std::atomic<uint64_t> accepted{0};
+};
+
+// Listeners of this process, set up once in main() before any connection is accepted. All of
+// them are handed to the new process at a binary upgrade, in one SCM_RIGHTS message.
+const size_t MAX_LISTENERS = 16;
+std::deque<Listener> listeners;
 
 // Forward declarations
-void handle_client(int client_socket, SSL_CTX *ctx);
+struct ParkedConnection;
+void handle_client(int client_socket, const PeerAddress& peer, const Listener *listener,
+                   ParkedConnection *resumed = nullptr);
+void discard_parked(ParkedConnection *conn);
+void shed_connection(int client_socket, ShedReason reason, const Listener *listener);
+void record_queue_sojourn(std::chrono::steady_clock::duration sojourn, size_t queued);
+
+// CoDel (Controlled Delay) admission: once every connection has waited longer than `target`
+// for a whole `interval`, start dropping, at a rate that grows with the square root of the
+// number of drops until waits fall below target again. Bursts that drain quickly are kept.
+class CoDel {
+public:
+    using Clock = std::chrono::steady_clock;
+    CoDel(std::chrono::milliseconds target, std::chrono::milliseconds interval)
+        : target(target), interval(interval) {}
+    bool should_drop(Clock::duration sojourn, Clock::time_point now);
+
+private:
+    Clock::time_point control_law(Clock::time_point from) const {
+        return from + std::chrono::duration_cast<Clock::duration>(interval / std::sqrt(double(count)));
+    }
+    Clock::duration target;
+    Clock::duration interval;
+    Clock::time_point first_above{};
+    Clock::time_point drop_next{};
+    uint32_t count = 0;
+    bool dropping = false;
+};
+
+bool CoDel::should_drop(Clock::duration sojourn, Clock::time_point now) {
+    if (sojourn < target) {
+        first_above = {};
+        dropping = false;
+        return false;
+    }
+    if (first_above == Clock::time_point{}) {
+        first_above = now + interval;
+        return false;
+    }
+    if (now < first_above)
+        return false;
+    if (!dropping) {
+        // Resume near the previous drop rate if the last dropping episode ended recently
+        dropping = true;
+        count = (count > 2 && now - drop_next < 8 * interval) ? count - 2 : 1;
+        drop_next = control_law(now);
+        return true;
+    }
+    if (now >= drop_next) {
+        count++;
+        drop_next = control_law(drop_next);
+        return true;
+    }
+    return false;
+}
+
+// CPU Placement: the CPUs this process may run on (its affinity mask, as set by taskset,
+// Docker's --cpuset-cpus or a cgroup cpuset) grouped by NUMA node, and the CPU quota of its
+// cgroup. Read once, before any worker narrows its own affinity.
+struct CpuTopology {
+    std::vector<int> cpus;
+    std::vector<std::vector<int>> nodes;   // allowed CPUs of each NUMA node that has any
+    double quota = 0;                      // CPUs worth of cgroup quota, 0 if unlimited
+};
+
+// Function to parse a kernel CPU list such as "0-3,8-11"
+std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream rs(range);
+        if (!(rs >> first))
+            continue;
+        last = (rs >> dash >> last) ? last : first;
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Function to read the cgroup CPU quota (v2 cpu.max, else v1 cfs_quota_us/cfs_period_us)
+double read_cgroup_quota() {
+    std::ifstream v2("/sys/fs/cgroup/cpu.max");
+    std::string quota;
+    double period = 0;
+    if (v2 >> quota >> period)
+        return (quota == "max" || period <= 0) ? 0 : std::stod(quota) / period;
+    std::ifstream v1_quota("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+    std::ifstream v1_period("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+    double us = 0;
+    if (v1_quota >> us && v1_period >> period && us > 0 && period > 0)
+        return us / period;
+    return 0;
+}
+
+const CpuTopology& cpu_topology() {
+    static const CpuTopology topology = [] {
+        CpuTopology topology;
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+                if (CPU_ISSET(cpu, &mask))
+                    topology.cpus.push_back(cpu);
+        }
+        if (topology.cpus.empty())
+            topology.cpus.push_back(0);
+
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator("/sys/devices/system/node", ec)) {
+            std::string name = entry.path().filename();
+            if (name.rfind("node", 0) != 0 || name.size() == 4 || !std::isdigit(static_cast<unsigned char>(name[4])))
+                continue;
+            std::ifstream file(entry.path() / "cpulist");
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> node;
+            for (int cpu : parse_cpu_list(list))
+                if (std::find(topology.cpus.begin(), topology.cpus.end(), cpu) != topology.cpus.end())
+                    node.push_back(cpu);
+            if (!node.empty())
+                topology.nodes.push_back(node);
+        }
+        if (topology.nodes.empty())
+            topology.nodes.push_back(topology.cpus);
+
+        topology.quota = read_cgroup_quota();
+        return topology;
+    }();
+    return topology;
+}
 
-// Thread Pool Class Definition
+// Function to choose the default worker count: one per usable CPU, fewer if the cgroup quota
+// allows less than that much CPU time
+int default_thread_count() {
+    const CpuTopology& topology = cpu_topology();
+    int count = static_cast<int>(topology.cpus.size());
+    if (topology.quota > 0)
+        count = std::min(count, static_cast<int>(std::ceil(topology.quota)));
+    return std::max(1, count);
+}
+
+// Function to place the calling worker according to cpu_affinity: "cpu" pins worker `slot` to
+// one CPU (round robin), "numa" confines it to the CPUs of one node (round robin over nodes) so
+// the memory it touches stays node-local, "none" leaves scheduling to the kernel
+void place_worker(size_t slot) {
+    auto live_mode = CPU_AFFINITY.get();
+    const std::string& mode = *live_mode;
+    if (mode != "cpu" && mode != "numa")
+        return;
+    const CpuTopology& topology = cpu_topology();
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (mode == "cpu") {
+        CPU_SET(topology.cpus[slot % topology.cpus.size()], &mask);
+    } else {
+        for (int cpu : topology.nodes[slot % topology.nodes.size()])
+            CPU_SET(cpu, &mask);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask) != 0)
+        std::cerr << "Failed to set worker CPU affinity" << std::endl;
+}
+
+// Thread Pool Class Definition. The queue of accepted sockets is bounded: enqueue() refuses a
+// socket when it is full, and with CoDel enabled workers shed sockets that waited too long.
+// The pool can be resized while running; surplus workers leave once their connection is done.
+// Connections parked on the event loop (coroutine handlers) count as in flight until they come
+// back through resume(), which queues them past the bound, or are let go with unpark().
 class ThreadPool {
 public:
-    ThreadPool(size_t num_threads, SSL_CTX *ctx);
+    ThreadPool(size_t num_threads, size_t max_queue, std::optional<CoDel> codel);
     ~ThreadPool();
-    void enqueue(int client_socket);
+    bool enqueue(int client_socket, const PeerAddress& peer, const Listener *listener);
+    // Waits until every queued and running connection is done, at most until `deadline`.
+    // Connections still queued at the deadline are closed unserved; returns true if none were
+    // left over and no worker is still busy.
+    bool drain(std::chrono::steady_clock::time_point deadline);
+    void resize(size_t num_threads);
+    void set_admission(size_t new_max_queue, std::optional<CoDel> new_codel);
+    size_t size();
+    void park();
+    void resume(int client_socket, const PeerAddress& peer, const Listener *listener, ParkedConnection *conn);
+    void unpark();
+    // Snapshot for the pool controller
+    struct Stats {
+        size_t workers;
+        size_t busy;
+        size_t queued;
+        std::chrono::steady_clock::duration oldest_wait;
+    };
+    Stats stats();
 
 private:
-    void worker();
-    std::vector<std::thread> workers;
-    std::queue<int> tasks;
+    struct QueuedSocket {
+        int fd;
+        PeerAddress peer;
+        const Listener *listener;
+        std::chrono::steady_clock::time_point enqueued;
+        ParkedConnection *parked = nullptr;   // owned; set for connections back from the event loop
+    };
+    void worker(size_t slot);
+    void join_retired();
+    // Held by resize() throughout, so the pool controller and a config reload cannot both grow
+    // `workers` and join and erase from it at once. Workers never take it.
+    std::mutex resize_mutex;
+    std::list<std::thread> workers;
+    std::vector<std::thread::id> retired;  // workers that have left, to be joined
+    size_t target;                         // number of workers wanted
+    size_t alive = 0;                      // number of workers running
+    std::queue<QueuedSocket> tasks;
+    size_t max_queue;
+    std::optional<CoDel> codel;
     std::mutex queue_mutex;
     std::condition_variable condition;
+    std::condition_variable idle_condition;
+    size_t busy = 0;
+    size_t parked = 0;
     bool stop = false;
-    SSL_CTX *ctx;
 };
 
 // Thread Pool Class Implementation
-ThreadPool::ThreadPool(size_t num_threads, SSL_CTX *ctx) : ctx(ctx) {
-    for (size_t i = 0; i < num_threads; ++i)
-        workers.emplace_back([this] { worker(); });
+ThreadPool::ThreadPool(size_t num_threads, size_t max_queue, std::optional<CoDel> codel)
+    : target(0), max_queue(max_queue), codel(codel) {
+    resize(num_threads);
 }
 
 ThreadPool::~ThreadPool() {
@@ -65,39 +599,233 @@ ThreadPool::~ThreadPool() {
         stop = true;
     }
     condition.notify_all();
+    std::lock_guard<std::mutex> resizing(resize_mutex);
     for (std::thread& worker : workers)
         worker.join();
 }
 
-void ThreadPool::enqueue(int client_socket) {
+void ThreadPool::resize(size_t num_threads) {
+    std::lock_guard<std::mutex> resizing(resize_mutex);
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        target = std::max<size_t>(1, num_threads);
+        for (; alive < target; alive++)
+            workers.emplace_back([this, slot = alive] { worker(slot); });
+    }
+    // Idle workers above the target notice it and leave right away, busy ones after their connection
+    condition.notify_all();
+    join_retired();
+}
+
+void ThreadPool::join_retired() {
+    std::vector<std::thread::id> ids;
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        ids.swap(retired);
+    }
+    for (std::thread::id id : ids) {
+        auto it = std::find_if(workers.begin(), workers.end(),
+                               [id](const std::thread& worker) { return worker.get_id() == id; });
+        it->join();
+        workers.erase(it);
+    }
+}
+
+void ThreadPool::set_admission(size_t new_max_queue, std::optional<CoDel> new_codel) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    max_queue = new_max_queue;
+    codel = new_codel;
+}
+
+size_t ThreadPool::size() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return alive;
+}
+
+void ThreadPool::park() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    parked++;
+}
+
+void ThreadPool::resume(int client_socket, const PeerAddress& peer, const Listener *listener,
+                        ParkedConnection *conn) {
     {
         std::unique_lock<std::mutex> lock(queue_mutex);
-        tasks.push(client_socket);
+        parked--;
+        tasks.push({client_socket, peer, listener, std::chrono::steady_clock::now(), conn});
     }
     condition.notify_one();
 }
 
-void ThreadPool::worker() {
+void ThreadPool::unpark() {
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        parked--;
+    }
+    idle_condition.notify_all();
+}
+
+ThreadPool::Stats ThreadPool::stats() {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    Stats stats{alive, busy, tasks.size(), {}};
+    if (!tasks.empty())
+        stats.oldest_wait = std::chrono::steady_clock::now() - tasks.front().enqueued;
+    return stats;
+}
+
+bool ThreadPool::enqueue(int client_socket, const PeerAddress& peer, const Listener *listener) {
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (tasks.size() >= max_queue)
+            return false;
+        tasks.push({client_socket, peer, listener, std::chrono::steady_clock::now()});
+    }
+    condition.notify_one();
+    return true;
+}
+
+void ThreadPool::worker(size_t slot) {
+    place_worker(slot);
     while (true) {
         int client_socket;
+        PeerAddress peer;
+        const Listener *listener;
+        ParkedConnection *resumed;
+        std::chrono::steady_clock::duration sojourn;
+        size_t queued;
+        bool drop = false;
         {
             std::unique_lock<std::mutex> lock(queue_mutex);
-            condition.wait(lock, [this] { return stop || !tasks.empty(); });
+            condition.wait(lock, [this] { return stop || !tasks.empty() || alive > target; });
             if (stop && tasks.empty())
                 return;
-            client_socket = tasks.front();
+            if (!stop && alive > target) {
+                alive--;
+                retired.push_back(std::this_thread::get_id());
+                return;
+            }
+            client_socket = tasks.front().fd;
+            peer = tasks.front().peer;
+            listener = tasks.front().listener;
+            resumed = tasks.front().parked;
+            auto now = std::chrono::steady_clock::now();
+            sojourn = now - tasks.front().enqueued;
             tasks.pop();
+            queued = tasks.size();
+            if (codel && !resumed)
+                drop = codel->should_drop(sojourn, now);
+            busy++;
+        }
+        record_queue_sojourn(sojourn, queued);
+        if (drop)
+            shed_connection(client_socket, SHED_CODEL, listener);
+        else
+            handle_client(client_socket, peer, listener, resumed);
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            busy--;
         }
-        handle_client(client_socket, ctx);
+        idle_condition.notify_all();
+    }
+}
+
+bool ThreadPool::drain(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    idle_condition.wait_until(lock, deadline, [this] { return tasks.empty() && busy == 0 && parked == 0; });
+    bool drained = tasks.empty() && busy == 0 && parked == 0;
+    while (!tasks.empty()) {
+        if (tasks.front().parked)
+            discard_parked(tasks.front().parked);
+        else
+            close(tasks.front().fd);
+        tasks.pop();
     }
+    return drained;
 }
 
 // Global mutex for logging
 std::mutex log_mutex;
 std::ofstream log_file;
 
+// Server Metrics: plain counters, rendered by the /metrics route
+struct Metrics {
+    std::atomic<uint64_t> compressed_responses{0};
+    std::atomic<uint64_t> compression_bytes_in{0};   // size of the uncompressed originals
+    std::atomic<uint64_t> compression_bytes_out{0};  // bytes actually sent for them
+    std::atomic<uint64_t> compression_cache_hits{0};
+    std::atomic<uint64_t> compression_cache_misses{0};
+    std::atomic<uint64_t> not_modified_responses{0};
+    std::atomic<uint64_t> partial_responses{0};
+    std::atomic<uint64_t> open_file_cache_hits{0};
+    std::atomic<uint64_t> open_file_cache_misses{0};
+    std::atomic<uint64_t> open_file_cache_negative_hits{0};
+    std::atomic<uint64_t> content_cache_hits{0};
+    std::atomic<uint64_t> content_cache_misses{0};
+    std::atomic<uint64_t> watcher_invalidations{0};
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> request_arena_bytes{0};
+    std::atomic<uint64_t> request_heap_allocations{0};
+    std::atomic<uint64_t> request_heap_bytes{0};
+    std::atomic<uint64_t> keepalive_requests{0};     // requests served on a reused connection
+    std::atomic<uint64_t> connections_reaped{0};     // deadlines fired by the timeout reaper
+    std::atomic<uint64_t> connection_timeouts[5]{};  // per Connection::Phase
+    std::atomic<uint64_t> accept_queue_length{0};
+    std::atomic<uint64_t> rate_limited[2]{};         // per RateLimiter::Bucket
+    std::atomic<uint64_t> rate_limit_evictions{0};
+    std::atomic<uint64_t> config_reloads{0};
+    std::atomic<uint64_t> worker_threads{0};
+    std::atomic<uint64_t> worker_busy_percent{0};   // over the last controller interval
+    std::atomic<uint64_t> pool_grows{0};
+    std::atomic<uint64_t> pool_shrinks{0};
+    std::atomic<uint64_t> async_handlers{0};
+    std::atomic<uint64_t> proxy_requests{0};
+    std::atomic<uint64_t> proxy_errors{0};
+    std::atomic<uint64_t> upstream_connections_opened{0};
+    std::atomic<uint64_t> upstream_connections_reused{0};
+    std::atomic<uint64_t> response_cache_hits{0};
+    std::atomic<uint64_t> response_cache_misses{0};
+    std::atomic<uint64_t> response_cache_coalesced{0};   // misses that waited for another request
+    std::atomic<uint64_t> response_cache_stores{0};
+    std::atomic<uint64_t> response_cache_rejected{0};    // refused by TinyLFU admission
+    std::atomic<uint64_t> response_cache_evictions{0};
+    std::atomic<uint64_t> websocket_sessions{0};
+    std::atomic<uint64_t> websocket_messages_received{0};
+    std::atomic<uint64_t> websocket_frames_sent{0};
+    std::atomic<uint64_t> websocket_broadcasts{0};
+    std::atomic<uint64_t> websocket_slow_consumers{0};   // dropped for an overfull send queue
+    std::atomic<uint64_t> websocket_timeouts{0};         // pings that went unanswered
+    std::atomic<uint64_t> sse_subscribers{0};
+    std::atomic<uint64_t> sse_events_published{0};
+    std::atomic<uint64_t> sse_events_dropped{0};         // under the "drop" policy
+    std::atomic<uint64_t> sse_slow_consumers{0};         // disconnected under "disconnect"
+    std::atomic<uint64_t> proxy_protocol_headers[2]{};   // per PROXY protocol version
+    std::atomic<uint64_t> proxy_protocol_errors{0};      // missing, malformed or cut-off headers
+    std::atomic<uint64_t> proxy_protocol_untrusted{0};   // from sources not in proxy_protocol_trusted
+    std::atomic<uint64_t> tcp_fastopen_connections{0};   // accepted with data in the SYN
+    std::atomic<uint64_t> config_reload_failures{0};
+    std::atomic<uint64_t> accept_queue_shed[SHED_REASONS]{};
+    // Histogram of the time accepted sockets spent queued before a worker picked them up
+    static constexpr int SOJOURN_BUCKETS_MS[] = {1, 5, 10, 50, 100, 500, 1000, 5000};
+    std::atomic<uint64_t> sojourn_buckets[std::size(SOJOURN_BUCKETS_MS)]{};
+    std::atomic<uint64_t> sojourn_count{0};
+    std::atomic<uint64_t> sojourn_us_total{0};
+};
+Metrics metrics;
+
+// Function to account for the time a socket spent in the accept queue
+void record_queue_sojourn(std::chrono::steady_clock::duration sojourn, size_t queued) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(sojourn).count();
+    for (size_t i = 0; i < std::size(Metrics::SOJOURN_BUCKETS_MS); i++) {
+        if (us <= Metrics::SOJOURN_BUCKETS_MS[i] * 1000LL)
+            metrics.sojourn_buckets[i]++;
+    }
+    metrics.sojourn_count++;
+    metrics.sojourn_us_total += us;
+    metrics.accept_queue_length = queued;
+}
+
 // Function to log messages
-void log(const std::string& message) {
+void log(std::string_view message) {
     std::lock_guard<std::mutex> lock(log_mutex);
     std::time_t now = std::time(nullptr);
     char buf[64];
@@ -105,335 +833,5576 @@ void log(const std::string& message) {
     log_file << "[" << buf << "] " << message << std::endl;
 }
 
-// Function to read the entire request from the client (SSL version)
-std::string ssl_read_request(SSL *ssl) {
-    std::string request;
-    char buffer[2048];
-    int bytes_read;
+// Upper bound on a request body, whether sized by Content-Length or chunked
+const size_t MAX_BODY_SIZE = 16 * 1024 * 1024;
+
+// I/O Buffer Pool: fixed-size slabs, one TLS record in size, shared by all connections. A
+// connection borrows a slab only while it has bytes in flight and returns it before going idle,
+// so idle connections cost no buffer memory. Up to `max_free` returned slabs are kept for reuse.
+class BufferPool {
+public:
+    static const size_t SLAB_SIZE = 16 * 1024;
+
+    // Move-only handle to a borrowed slab; returns it to the pool when destroyed
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(BufferPool *pool, char *slab) : pool(pool), slab(slab) {}
+        Lease(Lease&& other) noexcept : pool(other.pool), slab(std::exchange(other.slab, nullptr)) {}
+        Lease& operator=(Lease&& other) noexcept {
+            if (this != &other) {
+                reset();
+                pool = other.pool;
+                slab = std::exchange(other.slab, nullptr);
+            }
+            return *this;
+        }
+        ~Lease() { reset(); }
+        void reset() {
+            if (slab)
+                pool->release(std::exchange(slab, nullptr));
+        }
+        char* data() const { return slab; }
+        explicit operator bool() const { return slab != nullptr; }
+
+    private:
+        BufferPool *pool = nullptr;
+        char *slab = nullptr;
+    };
+
+    explicit BufferPool(size_t max_free) : max_free(max_free) {}
+    Lease acquire();
+    size_t in_use() const { return borrowed; }
+
+private:
+    void release(char *slab);
+    std::vector<char*> free_slabs;
+    size_t max_free;
+    std::atomic<size_t> borrowed{0};
+    std::mutex mutex;
+};
 
-    // Read the request line and headers
-    while ((bytes_read = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
-        request.append(buffer, bytes_read);
-        if (request.find("\r\n\r\n") != std::string::npos) {
-            break; // End of headers
+BufferPool::Lease BufferPool::acquire() {
+    borrowed++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!free_slabs.empty()) {
+            char *slab = free_slabs.back();
+            free_slabs.pop_back();
+            return Lease(this, slab);
         }
     }
+    return Lease(this, new char[SLAB_SIZE]);
+}
 
-    // Parse headers to find Content-Length
-    size_t content_length = 0;
-    size_t pos = request.find("Content-Length:");
-    if (pos != std::string::npos) {
-        size_t end_of_line = request.find("\r\n", pos);
-        std::string content_length_str = request.substr(pos + 15, end_of_line - pos - 15);
-        content_length = std::stoul(content_length_str);
+void BufferPool::release(char *slab) {
+    borrowed--;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (free_slabs.size() < max_free) {
+            free_slabs.push_back(slab);
+            return;
+        }
     }
+    delete[] slab;
+}
 
-    // Read the body if Content-Length is specified
-    if (content_length > 0) {
-        size_t total_bytes_read = 0;
-        while (total_bytes_read < content_length) {
-            bytes_read = SSL_read(ssl, buffer, std::min(sizeof(buffer), content_length - total_bytes_read));
-            if (bytes_read <= 0) break;
-            request.append(buffer, bytes_read);
-            total_bytes_read += bytes_read;
+BufferPool buffer_pool(1024);
+
+// Connection deadline, linked into one slot of a TimerWheel while armed. When it fires the
+// socket is shut down, which makes the worker's blocked SSL call return with an error.
+struct TimerLink {
+    TimerLink *prev = nullptr;
+    TimerLink *next = nullptr;
+};
+
+struct ConnectionTimer : TimerLink {
+    int fd = -1;
+    uint64_t expires = 0;
+    bool idle = false;  // waiting between requests, safe to close early
+    std::atomic<bool> expired{false};
+    bool armed() const { return next != nullptr; }
+};
+
+// Hierarchical Timing Wheel: LEVELS wheels of SLOTS slots, each level's slot spanning a full
+// turn of the level below. Arming, disarming and firing a timer are O(1); timers on the upper
+// levels are moved down ("cascaded") as their slot comes up. One wheel per worker thread keeps
+// the lock uncontended apart from the reaper's tick.
+class TimerWheel {
+public:
+    static const int TICK_MS = 100;
+    TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+    void schedule(ConnectionTimer& timer, int timeout_ms, bool idle = false);
+    void cancel(ConnectionTimer& timer);
+    // Fires every timer due up to `tick`; returns how many fired
+    size_t advance(uint64_t tick);
+    // Fires every armed timer now, or only those of idle connections
+    size_t expire_all(bool idle_only);
+    static uint64_t current_tick();
+
+private:
+    static const int LEVELS = 4;
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    void insert(ConnectionTimer& timer);
+    static void unlink(TimerLink& link);
+    static void fire(ConnectionTimer& timer);
+    TimerLink slots[LEVELS][SLOTS];
+    uint64_t now;
+    std::mutex mutex;
+};
+
+TimerWheel::TimerWheel() : now(current_tick()) {
+    for (auto& level : slots)
+        for (TimerLink& slot : level)
+            slot.prev = slot.next = &slot;
+}
+
+uint64_t TimerWheel::current_tick() {
+    auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count() / TICK_MS;
+}
+
+void TimerWheel::schedule(ConnectionTimer& timer, int timeout_ms, bool idle) {
+    // Round up so a timer never fires early
+    uint64_t expires = current_tick() + (std::max(timeout_ms, 1) + TICK_MS - 1) / TICK_MS + 1;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (timer.armed())
+        unlink(timer);
+    timer.expires = std::max(expires, now + 1);
+    timer.idle = idle;
+    timer.expired = false;
+    insert(timer);
+}
+
+void TimerWheel::cancel(ConnectionTimer& timer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (timer.armed())
+        unlink(timer);
+}
+
+// Function to link a timer into the slot for its expiry: the lowest level whose span covers it
+void TimerWheel::insert(ConnectionTimer& timer) {
+    uint64_t delta = timer.expires - now;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1))))
+        level++;
+    if (level == LEVELS - 1 && delta >= (uint64_t(1) << (SLOT_BITS * LEVELS)))
+        timer.expires = now + (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+    TimerLink& slot = slots[level][(timer.expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+    timer.prev = slot.prev;
+    timer.next = &slot;
+    slot.prev->next = &timer;
+    slot.prev = &timer;
+}
+
+void TimerWheel::unlink(TimerLink& link) {
+    link.prev->next = link.next;
+    link.next->prev = link.prev;
+    link.prev = link.next = nullptr;
+}
+
+void TimerWheel::fire(ConnectionTimer& timer) {
+    unlink(timer);
+    timer.expired = true;
+    shutdown(timer.fd, SHUT_RDWR);
+}
+
+size_t TimerWheel::expire_all(bool idle_only) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t fired = 0;
+    for (auto& level : slots) {
+        for (TimerLink& slot : level) {
+            for (TimerLink *link = slot.next; link != &slot;) {
+                auto& timer = static_cast<ConnectionTimer&>(*link);
+                link = link->next;
+                if (!idle_only || timer.idle) {
+                    fire(timer);
+                    fired++;
+                }
+            }
         }
     }
+    return fired;
+}
 
-    return request;
+size_t TimerWheel::advance(uint64_t tick) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t fired = 0;
+    while (now < tick) {
+        now++;
+        // Whenever a level wraps, pull the next slot of the level above down into the wheel
+        for (int level = 1; level < LEVELS; level++) {
+            if ((now & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0)
+                break;
+            TimerLink& slot = slots[level][(now >> (SLOT_BITS * level)) & (SLOTS - 1)];
+            while (slot.next != &slot) {
+                auto& timer = static_cast<ConnectionTimer&>(*slot.next);
+                unlink(timer);
+                insert(timer);
+            }
+        }
+
+        TimerLink& slot = slots[0][now & (SLOTS - 1)];
+        while (slot.next != &slot) {
+            fire(static_cast<ConnectionTimer&>(*slot.next));
+            fired++;
+        }
+    }
+    return fired;
+}
+
+// Timeout Reaper: a single thread that advances every worker's wheel once per tick
+class TimeoutReaper {
+public:
+    void start();
+    void stop();
+    void add(TimerWheel *wheel);
+    void remove(TimerWheel *wheel);
+    // Closes connections ahead of their deadlines, e.g. to drain the server
+    void expire_all(bool idle_only);
+
+private:
+    void run();
+    std::vector<TimerWheel*> wheels;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::thread thread;
+};
+
+void TimeoutReaper::start() {
+    thread = std::thread([this] { run(); });
+}
+
+void TimeoutReaper::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    if (thread.joinable())
+        thread.join();
 }
 
-// Function to parse the HTTP request
-std::unordered_map<std::string, std::string> parse_request(const std::string& request) {
-    std::unordered_map<std::string, std::string> request_info;
-    std::istringstream request_stream(request);
-    std::string line;
+void TimeoutReaper::add(TimerWheel *wheel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    wheels.push_back(wheel);
+}
 
-    // Get the request line
-    if (std::getline(request_stream, line)) {
-        std::istringstream line_stream(line);
-        line_stream >> request_info["method"];
-        line_stream >> request_info["path"];
-        line_stream >> request_info["version"];
+void TimeoutReaper::remove(TimerWheel *wheel) {
+    std::lock_guard<std::mutex> lock(mutex);
+    wheels.erase(std::find(wheels.begin(), wheels.end(), wheel));
+}
+
+void TimeoutReaper::expire_all(bool idle_only) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (TimerWheel *wheel : wheels)
+        wheel->expire_all(idle_only);
+}
+
+void TimeoutReaper::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!wakeup.wait_for(lock, std::chrono::milliseconds(TimerWheel::TICK_MS),
+                            [this] { return stopping; })) {
+        uint64_t tick = TimerWheel::current_tick();
+        for (TimerWheel *wheel : wheels)
+            metrics.connections_reaped += wheel->advance(tick);
     }
+}
 
-    // Parse headers
-    while (std::getline(request_stream, line) && line != "\r") {
-        if (line == "\r" || line.empty()) {
+TimeoutReaper timeout_reaper;
+
+// Function to get the calling worker's timer wheel, created and registered on first use
+TimerWheel& worker_timer_wheel() {
+    struct RegisteredWheel {
+        TimerWheel wheel;
+        RegisteredWheel() { timeout_reaper.add(&wheel); }
+        ~RegisteredWheel() { timeout_reaper.remove(&wheel); }
+    };
+    thread_local RegisteredWheel registered;
+    return registered.wheel;
+}
+
+// Transport I/O: connections from TLS listeners go through their SSL session, plaintext ones
+// (ssl == nullptr) straight to the socket. Results follow SSL_read/SSL_write and errors are
+// reported as SSL_ERROR_* codes, so callers handle both kinds of connection alike. Unlike
+// SSL_write, a plaintext write on a non-blocking socket may take only part of the data.
+int transport_read(SSL *ssl, int fd, char *data, int size) {
+    if (ssl)
+        return SSL_read(ssl, data, size);
+    ssize_t n;
+    do {
+        n = recv(fd, data, size, 0);
+    } while (n < 0 && errno == EINTR);
+    return static_cast<int>(n);
+}
+
+int transport_write(SSL *ssl, int fd, const char *data, int size) {
+    if (ssl)
+        return SSL_write(ssl, data, size);
+    ssize_t n;
+    do {
+        n = send(fd, data, size, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    return static_cast<int>(n);
+}
+
+// Function to classify a transport_read/transport_write result that moved no data
+int transport_error(SSL *ssl, int result, bool writing) {
+    if (ssl)
+        return SSL_get_error(ssl, result);
+    if (result == 0 && !writing)
+        return SSL_ERROR_ZERO_RETURN;
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return writing ? SSL_ERROR_WANT_WRITE : SSL_ERROR_WANT_READ;
+    return SSL_ERROR_SYSCALL;
+}
+
+// Function to count bytes already decrypted but not yet read (always 0 without TLS)
+int transport_pending(SSL *ssl) {
+    return ssl ? SSL_pending(ssl) : 0;
+}
+
+// Client connection: the socket, its TLS session and, while a request is in flight, a slab
+// borrowed from the buffer pool. Bytes a client sent ahead of the current request (pipelining)
+// stay at the front of the slab for the next one. Every blocking phase runs under a deadline
+// on the worker's timer wheel; the body and write deadlines are pushed back on each transfer.
+struct Connection {
+    enum Phase { HANDSHAKE, HEADER, BODY, WRITE, KEEPALIVE, PHASES };
+    static constexpr const char *PHASE_NAMES[PHASES] = {"handshake", "header", "body", "write",
+                                                        "keepalive"};
+
+    int fd;
+    SSL *ssl;                  // null for plaintext connections
+    BufferPool::Lease buffer;
+    size_t buffered = 0;
+    TimerWheel& wheel;
+    ConnectionTimer timer;
+    Phase phase = HANDSHAKE;
+    PeerAddress peer;
+    const Listener *listener = nullptr;
+
+    Connection(int fd, SSL *ssl) : fd(fd), ssl(ssl), wheel(worker_timer_wheel()) { timer.fd = fd; }
+    ~Connection() { disarm(); }
+    void arm(Phase next_phase, int timeout_ms) {
+        phase = next_phase;
+        wheel.schedule(timer, timeout_ms, phase == KEEPALIVE);
+    }
+    void disarm() { wheel.cancel(timer); }
+    bool timed_out() const { return timer.expired; }
+
+    // Reads into the slab (borrowing one if needed); returns transport_read's result
+    int read() {
+        if (!buffer)
+            buffer = buffer_pool.acquire();
+        if (phase == BODY)
+            arm(BODY, BODY_TIMEOUT_MS);
+        if (abort_connections)
+            return -1;
+        return transport_read(ssl, fd, buffer.data(), BufferPool::SLAB_SIZE);
+    }
+    bool write(const char *data, size_t len) {
+        arm(WRITE, WRITE_TIMEOUT_MS);
+        while (len > 0) {
+            if (abort_connections)
+                return false;
+            int n = transport_write(ssl, fd, data, len);
+            if (n <= 0)
+                return false;
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+    // Keeps `data` for the next request, or gives the slab back when there is nothing left over
+    bool carry_over(std::string_view data) {
+        buffered = 0;
+        if (data.empty()) {
+            buffer.reset();
+            return true;
+        }
+        if (data.size() > BufferPool::SLAB_SIZE)
+            return false;
+        if (!buffer)
+            buffer = buffer_pool.acquire();
+        std::memcpy(buffer.data(), data.data(), data.size());
+        buffered = data.size();
+        return true;
+    }
+};
+
+// Connection handed to the event loop while a coroutine handler produces its response: the
+// socket (non-blocking meanwhile), its TLS session, any pipelined bytes already read, and where
+// the keep-alive loop stands. It returns to the thread pool once the response is written.
+struct ParkedConnection {
+    int fd;
+    SSL *ssl;
+    PeerAddress peer;
+    const Listener *listener;
+    BufferPool::Lease buffer;
+    size_t buffered;
+    int served;          // requests done on this connection, including the parked one
+    bool keep_alive;
+};
+
+// Function to switch a socket between blocking and non-blocking mode
+void set_nonblocking(int fd, bool nonblocking) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, nonblocking ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+// Function to close a parked connection without sending anything more
+void discard_parked(ParkedConnection *conn) {
+    SSL_free(conn->ssl);
+    close(conn->fd);
+    delete conn;
+}
+
+// PROXY Protocol: a load balancer in front of a listener with proxy_protocol set sends the
+// client's address ahead of the connection's own bytes, either as a text line (v1, "PROXY TCP4
+// 203.0.113.7 10.0.0.1 51234 443\r\n") or as a binary header (v2). The header is parsed where
+// it lies in the socket buffer and consumed before the TLS handshake, and the address it names
+// replaces the socket's peer for logging, rate limiting and X-Forwarded-For. Only sources in
+// proxy_protocol_trusted may send one; a connection without a valid header is closed.
+enum ProxyHeaderStatus { PROXY_HEADER_OK, PROXY_HEADER_INCOMPLETE, PROXY_HEADER_INVALID };
+
+const size_t PROXY_V1_MAX_LENGTH = 107;   // longest v1 line, CRLF included
+const char PROXY_V2_SIGNATURE[12] = {'\r', '\n', '\r', '\n', '\0', '\r', '\n', 'Q', 'U', 'I', 'T', '\n'};
+
+// Function to parse the PROXY header at the start of `data`. On PROXY_HEADER_OK, `length` is the
+// header's full size (the TLVs of a v2 header may reach past `data`), `version` is 1 or 2, and
+// `peer` is the client it names. `peer` is left alone for connections the balancer opened
+// itself (v1 UNKNOWN, v2 LOCAL) and for clients that have no IP address.
+ProxyHeaderStatus parse_proxy_header(std::string_view data, size_t& length, int& version, PeerAddress& peer) {
+    static constexpr std::string_view V1_PREFIX = "PROXY ";
+    if (data.empty())
+        return PROXY_HEADER_INCOMPLETE;
+    PeerAddress client;
+
+    if (data[0] == V1_PREFIX[0]) {
+        version = 1;
+        if (data.substr(0, V1_PREFIX.size()) != V1_PREFIX.substr(0, std::min(data.size(), V1_PREFIX.size())))
+            return PROXY_HEADER_INVALID;
+        size_t end = data.substr(0, PROXY_V1_MAX_LENGTH).find("\r\n");
+        if (end == std::string_view::npos)
+            return data.size() < PROXY_V1_MAX_LENGTH ? PROXY_HEADER_INCOMPLETE : PROXY_HEADER_INVALID;
+        length = end + 2;
+        std::string_view line = data.substr(V1_PREFIX.size(), end - V1_PREFIX.size());
+        if (line.starts_with("UNKNOWN"))
+            return PROXY_HEADER_OK;
+
+        // "TCP4|TCP6 source destination source-port destination-port"
+        if (std::count(line.begin(), line.end(), ' ') != 4)
+            return PROXY_HEADER_INVALID;
+        std::string_view fields[5];
+        for (std::string_view& field : fields) {
+            size_t space = std::min(line.find(' '), line.size());
+            field = line.substr(0, space);
+            line.remove_prefix(std::min(space + 1, line.size()));
+        }
+        int family = fields[0] == "TCP4" ? AF_INET : fields[0] == "TCP6" ? AF_INET6 : AF_UNSPEC;
+        int port = -1;
+        auto [last, ec] = std::from_chars(fields[3].data(), fields[3].data() + fields[3].size(), port);
+        char address[INET6_ADDRSTRLEN];
+        if (family == AF_UNSPEC || fields[1].size() >= sizeof(address) || ec != std::errc() ||
+            last != fields[3].data() + fields[3].size() || port < 0 || port > 65535)
+            return PROXY_HEADER_INVALID;
+        std::memcpy(address, fields[1].data(), fields[1].size());
+        address[fields[1].size()] = '\0';
+        if (inet_pton(family, address, family == AF_INET ? &client.ip[12] : client.ip.data()) != 1)
+            return PROXY_HEADER_INVALID;
+        if (family == AF_INET)
+            client.ip[10] = client.ip[11] = 0xff;
+        client.port = port;
+        peer = client;
+        return PROXY_HEADER_OK;
+    }
+
+    if (data[0] == PROXY_V2_SIGNATURE[0]) {
+        version = 2;
+        if (std::memcmp(data.data(), PROXY_V2_SIGNATURE, std::min(data.size(), sizeof(PROXY_V2_SIGNATURE))) != 0)
+            return PROXY_HEADER_INVALID;
+        if (data.size() < 16)
+            return PROXY_HEADER_INCOMPLETE;
+        auto byte = [&data](size_t i) { return static_cast<uint8_t>(data[i]); };
+        uint8_t command = byte(12);
+        uint8_t family = byte(13) >> 4;   // 1 AF_INET, 2 AF_INET6, 3 AF_UNIX
+        size_t address_length = size_t(byte(14)) << 8 | byte(15);
+        length = 16 + address_length;
+        if ((command >> 4) != 2 || (command & 0xf) > 1)
+            return PROXY_HEADER_INVALID;
+        if ((command & 0xf) == 0)   // LOCAL
+            return PROXY_HEADER_OK;
+        size_t needed = family == 1 ? 12 : family == 2 ? 36 : 0;
+        if (address_length < needed)
+            return PROXY_HEADER_INVALID;
+        if (data.size() < 16 + needed)
+            return PROXY_HEADER_INCOMPLETE;
+        if (family == 1) {
+            client.ip[10] = client.ip[11] = 0xff;
+            std::memcpy(&client.ip[12], data.data() + 16, 4);
+            client.port = byte(24) << 8 | byte(25);
+        } else if (family == 2) {
+            std::memcpy(client.ip.data(), data.data() + 16, 16);
+            client.port = byte(48) << 8 | byte(49);
+        } else {
+            return PROXY_HEADER_OK;
+        }
+        peer = client;
+        return PROXY_HEADER_OK;
+    }
+    return PROXY_HEADER_INVALID;
+}
+
+// Function to consume the PROXY header a connection starts with and take the client's address
+// from it. The header is only peeked at until it is complete, so no byte of the TLS handshake
+// or request behind it is read. False if the connection is to be closed.
+bool read_proxy_header(Connection& conn) {
+    const std::vector<AddressRange>& trusted = conn.listener->proxy_trusted;
+    if (!conn.peer.local && !trusted.empty() &&
+        std::none_of(trusted.begin(), trusted.end(), [&conn](const AddressRange& range) { return range.contains(conn.peer); })) {
+        metrics.proxy_protocol_untrusted++;
+        return false;
+    }
+
+    // A v1 line or a v2 header with an IPv6 address fits; v2 TLVs past it are skipped unread
+    char header[128];
+    size_t have = 0;   // bytes already taken off the socket, all of them part of the header
+    while (true) {
+        ssize_t n = recv(conn.fd, header + have, sizeof(header) - have, MSG_PEEK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        size_t length;
+        int version;
+        ProxyHeaderStatus status = parse_proxy_header({header, have + n}, length, version, conn.peer);
+        if (status == PROXY_HEADER_INVALID)
+            break;
+        if (status == PROXY_HEADER_INCOMPLETE) {
+            // Everything seen belongs to the header: take it, so the next peek waits for more
+            if (recv(conn.fd, header + have, n, 0) != n)
+                break;
+            have += n;
+            continue;
+        }
+        for (size_t left = length - have; left > 0;) {
+            ssize_t taken = recv(conn.fd, header, std::min(left, sizeof(header)), 0);
+            if (taken < 0 && errno == EINTR)
+                continue;
+            if (taken <= 0) {
+                metrics.proxy_protocol_errors++;
+                return false;
+            }
+            left -= taken;
+        }
+        metrics.proxy_protocol_headers[version - 1]++;
+        return true;
+    }
+    metrics.proxy_protocol_errors++;
+    return false;
+}
+
+// Load Shedder: answers connections the pool has no room for with a precomputed 503 from a
+// thread of its own, so turning clients away never occupies a worker. The whole exchange
+// (handshake, one read, one write) runs under a single short deadline, and when even the
+// shedder is backed up the socket is simply closed.
+class LoadShedder {
+public:
+    static const int SHED_TIMEOUT_MS = 1000;
+    explicit LoadShedder(size_t max_queue) : max_queue(max_queue) {}
+    void start();
+    void stop();
+    bool offer(int client_socket, const Listener *listener);
+
+private:
+    void run();
+    void reject(int client_socket, const Listener *listener);
+    std::queue<std::pair<int, const Listener*>> sockets;
+    size_t max_queue;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool started = false;
+    bool stopping = false;
+    std::thread thread;
+};
+
+void LoadShedder::start() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        started = true;
+    }
+    thread = std::thread([this] { run(); });
+}
+
+void LoadShedder::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+bool LoadShedder::offer(int client_socket, const Listener *listener) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!started || stopping || sockets.size() >= max_queue)
+            return false;
+        sockets.push({client_socket, listener});
+    }
+    condition.notify_one();
+    return true;
+}
+
+void LoadShedder::run() {
+    while (true) {
+        std::pair<int, const Listener*> next;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !sockets.empty(); });
+            if (stopping && sockets.empty())
+                return;
+            next = sockets.front();
+            sockets.pop();
+        }
+        reject(next.first, next.second);
+    }
+}
+
+void LoadShedder::reject(int client_socket, const Listener *listener) {
+    static const char service_unavailable[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                              "Retry-After: 1\r\n"
+                                              "Content-Length: 0\r\n"
+                                              "Connection: close\r\n\r\n";
+    SSL *ssl = nullptr;
+    if (listener->mode == Listener::TLS) {
+        ssl = SSL_new(listener->ctx);
+        SSL_set_fd(ssl, client_socket);
+    }
+    {
+        Connection conn(client_socket, ssl);
+        conn.listener = listener;
+        conn.arm(Connection::HANDSHAKE, SHED_TIMEOUT_MS);
+        // Behind a balancer the PROXY header has to be taken off before the handshake
+        bool proxied = true;
+        if (listener->proxy_protocol) {
+            sockaddr_storage addr{};
+            socklen_t length = sizeof(addr);
+            getpeername(client_socket, (sockaddr*)&addr, &length);
+            conn.peer = PeerAddress::from(addr);
+            proxied = read_proxy_header(conn);
+        }
+        if (proxied && (!ssl || SSL_accept(ssl) > 0)) {
+            // Take in (the start of) the request first so closing does not reset the connection
+            // before the client has read the answer
+            char request[1024];
+            transport_read(ssl, client_socket, request, sizeof(request));
+            transport_write(ssl, client_socket, service_unavailable, sizeof(service_unavailable) - 1);
+            if (ssl && !conn.timed_out())
+                SSL_shutdown(ssl);
+        }
+    }
+    SSL_free(ssl);
+    close(client_socket);
+}
+
+LoadShedder load_shedder(64);
+
+// Function to turn away a connection the thread pool could not take
+void shed_connection(int client_socket, ShedReason reason, const Listener *listener) {
+    metrics.accept_queue_shed[reason]++;
+    if (*SHED_MODE.get() == "503" && load_shedder.offer(client_socket, listener))
+        return;
+    close(client_socket);
+}
+
+// Rate Limiter: token buckets per client address (or per CIDR block, see the prefix settings),
+// one for new connections and one for requests. Buckets live in a fixed-size open-addressing
+// table split into independently locked shards, so memory stays bounded however many
+// addresses show up. An entry whose buckets would have refilled completely is as good as
+// empty and is reused lazily; when a probe window has no such slot, the least recently used
+// entry is evicted. Slots are chosen by a hash seeded at startup, so clients cannot aim many
+// addresses at the same window.
+class RateLimiter {
+public:
+    enum Bucket { CONNECTIONS, REQUESTS, BUCKETS };
+    void configure(const double rates[BUCKETS], const double bursts[BUCKETS],
+                   int ipv4_prefix, int ipv6_prefix, size_t table_size);
+    bool allow(const PeerAddress& peer, Bucket bucket);
+
+private:
+    static const size_t SHARDS = 256;
+    static const size_t PROBES = 8;
+    struct Entry {
+        uint64_t key[2];
+        float tokens[BUCKETS];
+        uint64_t last_ms;  // 0 marks a slot that was never used
+    };
+    struct alignas(64) Shard {
+        std::mutex mutex;
+    };
+    static std::array<uint8_t, 16> prefix_mask(int bits);
+    uint64_t hash(const uint64_t key[2]) const;
+
+    double rates[BUCKETS] = {};
+    double bursts[BUCKETS] = {};
+    uint64_t idle_ms = 0;  // time after which every bucket of an entry is full again
+    std::array<uint8_t, 16> v4_mask{};
+    std::array<uint8_t, 16> v6_mask{};
+    uint64_t seed[3] = {};
+    std::vector<Entry> entries;
+    size_t shard_size = 0;
+    std::unique_ptr<Shard[]> shards;
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    std::shared_mutex config_mutex;  // held exclusively only while (re)configuring
+};
+
+std::array<uint8_t, 16> RateLimiter::prefix_mask(int bits) {
+    std::array<uint8_t, 16> mask{};
+    for (int i = 0; i < 16; i++)
+        mask[i] = uint8_t(0xff00 >> std::clamp(bits - i * 8, 0, 8));
+    return mask;
+}
+
+void RateLimiter::configure(const double new_rates[BUCKETS], const double new_bursts[BUCKETS],
+                            int ipv4_prefix, int ipv6_prefix, size_t table_size) {
+    std::unique_lock<std::shared_mutex> config_lock(config_mutex);
+    double refill_seconds = 0;
+    bool enabled = false;
+    for (int b = 0; b < BUCKETS; b++) {
+        rates[b] = new_rates[b];
+        bursts[b] = std::max(new_bursts[b], 1.0);
+        if (rates[b] > 0) {
+            enabled = true;
+            refill_seconds = std::max(refill_seconds, bursts[b] / rates[b]);
+        }
+    }
+    idle_ms = uint64_t(refill_seconds * 1000) + 1;
+    // IPv4 prefixes apply to the last four bytes of the mapped form
+    v4_mask = prefix_mask(96 + std::clamp(ipv4_prefix, 0, 32));
+    v6_mask = prefix_mask(std::clamp(ipv6_prefix, 0, 128));
+
+    std::random_device random;
+    for (uint64_t& word : seed)
+        word = (uint64_t(random()) << 32) ^ random();
+
+    entries.clear();
+    entries.shrink_to_fit();
+    shard_size = 0;
+    if (!enabled)
+        return;
+    shard_size = std::max<size_t>(PROBES, (table_size + SHARDS - 1) / SHARDS);
+    entries.assign(shard_size * SHARDS, Entry{});
+    shards = std::make_unique<Shard[]>(SHARDS);
+}
+
+uint64_t RateLimiter::hash(const uint64_t key[2]) const {
+    // Two rounds of 64x64->128 bit multiply-and-fold over the seeded key
+    auto mix = [](uint64_t a, uint64_t b) {
+        unsigned __int128 product = (unsigned __int128)a * b;
+        return uint64_t(product) ^ uint64_t(product >> 64);
+    };
+    return mix(mix(key[0] ^ seed[0], key[1] ^ seed[1]), seed[2] | 1);
+}
+
+bool RateLimiter::allow(const PeerAddress& peer, Bucket bucket) {
+    // Unix socket peers are local processes (a sidecar) with no address to tell clients apart by
+    if (peer.local)
+        return true;
+    std::shared_lock<std::shared_mutex> config_lock(config_mutex);
+    if (rates[bucket] <= 0 || entries.empty())
+        return true;
+
+    const auto& mask = peer.is_v4() ? v4_mask : v6_mask;
+    uint8_t masked[16];
+    for (int i = 0; i < 16; i++)
+        masked[i] = peer.ip[i] & mask[i];
+    uint64_t key[2];
+    std::memcpy(key, masked, sizeof(key));
+
+    uint64_t h = hash(key);
+    size_t shard = h % SHARDS;
+    Entry *window = &entries[shard * shard_size];
+    size_t start = (h / SHARDS) % shard_size;
+    uint64_t now = uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - epoch).count()) + 1;
+
+    std::lock_guard<std::mutex> lock(shards[shard].mutex);
+    Entry *entry = nullptr;
+    Entry *oldest = nullptr;
+    Entry *reusable = nullptr;
+    for (size_t i = 0; i < PROBES; i++) {
+        Entry& slot = window[(start + i) % shard_size];
+        if (slot.last_ms != 0 && slot.key[0] == key[0] && slot.key[1] == key[1]) {
+            entry = &slot;
+            break;
+        }
+        if (!reusable && (slot.last_ms == 0 || now - slot.last_ms >= idle_ms))
+            reusable = &slot;
+        if (!oldest || slot.last_ms < oldest->last_ms)
+            oldest = &slot;
+    }
+    if (!entry) {
+        if (!reusable) {
+            reusable = oldest;
+            metrics.rate_limit_evictions++;
+        }
+        entry = reusable;
+        entry->key[0] = key[0];
+        entry->key[1] = key[1];
+        for (int b = 0; b < BUCKETS; b++)
+            entry->tokens[b] = float(bursts[b]);
+        entry->last_ms = now;
+    }
+
+    // Refill for the time since the entry was last touched, then try to take a token
+    double elapsed = double(now - entry->last_ms) / 1000;
+    for (int b = 0; b < BUCKETS; b++)
+        entry->tokens[b] = float(std::min(bursts[b], entry->tokens[b] + elapsed * rates[b]));
+    entry->last_ms = now;
+    if (entry->tokens[bucket] < 1) {
+        metrics.rate_limited[bucket]++;
+        return false;
+    }
+    entry->tokens[bucket] -= 1;
+    return true;
+}
+
+RateLimiter rate_limiter;
+
+// Function to strip leading and trailing spaces/tabs
+std::string_view trim(std::string_view text) {
+    size_t first = text.find_first_not_of(" \t");
+    if (first == std::string_view::npos)
+        return {};
+    return text.substr(first, text.find_last_not_of(" \t") - first + 1);
+}
+
+// Function to call `fn` on each trimmed, non-empty element of a comma-separated header value
+// until it returns false
+template <typename Fn>
+void for_each_token(std::string_view list, Fn fn) {
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view token = trim(list.substr(0, comma));
+        if (!token.empty() && !fn(token))
+            return;
+        if (comma == std::string_view::npos)
+            break;
+        list.remove_prefix(comma + 1);
+    }
+}
+
+// Function to find a header value in a raw header block (case-insensitive name match)
+std::string_view find_raw_header(std::string_view headers, std::string_view name) {
+    size_t line_start = headers.find("\r\n");
+    while (line_start != std::string_view::npos) {
+        line_start += 2;
+        size_t line_end = headers.find("\r\n", line_start);
+        if (line_end == std::string_view::npos || line_end == line_start)
+            break;
+        if (line_end - line_start > name.size() && headers[line_start + name.size()] == ':' &&
+            strncasecmp(headers.data() + line_start, name.data(), name.size()) == 0) {
+            return trim(headers.substr(line_start + name.size() + 1,
+                                       line_end - line_start - name.size() - 1));
+        }
+        line_start = line_end;
+    }
+    return {};
+}
+
+// Function to compare two strings ignoring ASCII case
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+// Function to decode a chunked request body. `pending` holds the bytes already read past the
+// headers; consumed input is discarded as decoding proceeds so only the decoded body grows.
+// Whatever follows the final chunk is left in `pending`.
+bool read_chunked_body(Connection& conn, std::pmr::string& pending, std::pmr::string& body) {
+    auto fill = [&]() {
+        int bytes_read = conn.read();
+        if (bytes_read <= 0)
+            return false;
+        pending.append(conn.buffer.data(), bytes_read);
+        return true;
+    };
+
+    size_t pos = 0;
+    while (true) {
+        // Chunk size line: hex length, optionally followed by ";extensions"
+        size_t eol;
+        while ((eol = pending.find("\r\n", pos)) == std::string::npos)
+            if (!fill()) return false;
+        size_t chunk_size = 0;
+        auto [end, ec] = std::from_chars(pending.data() + pos, pending.data() + eol, chunk_size, 16);
+        if (ec != std::errc() || end == pending.data() + pos)
+            return false;
+        pos = eol + 2;
+
+        if (chunk_size == 0) {
+            // Skip optional trailers up to the terminating empty line
+            while (true) {
+                while ((eol = pending.find("\r\n", pos)) == std::string::npos)
+                    if (!fill()) return false;
+                bool last = (eol == pos);
+                pos = eol + 2;
+                if (last) break;
+            }
+            pending.erase(0, pos);
+            return true;
+        }
+
+        // Compared without adding to body.size(), which a huge declared size would wrap around
+        if (chunk_size > MAX_BODY_SIZE - body.size())
+            return false;
+        while (pending.size() < pos + chunk_size + 2)
+            if (!fill()) return false;
+        if (pending.compare(pos + chunk_size, 2, "\r\n") != 0)
+            return false;
+        body.append(pending, pos, chunk_size);
+        pos += chunk_size + 2;
+
+        pending.erase(0, pos);
+        pos = 0;
+    }
+}
+
+// Function to read the next request from the client (SSL version). The request is stored in the
+// request arena and any bytes past its end are carried over on the connection for the next one.
+// An empty result means the client went away or sent something unacceptable.
+std::pmr::string ssl_read_request(Connection& conn) {
+    std::pmr::string request(request_memory());
+    request.reserve(4096);
+    int bytes_read;
+    size_t header_end = std::string::npos;
+    auto fail = [&]() {
+        conn.carry_over({});
+        return std::pmr::string(request_memory());
+    };
+
+    // Start from whatever the client pipelined behind the previous request
+    request.append(conn.buffer.data(), conn.buffered);
+    conn.buffered = 0;
+
+    // Read the request line and headers, which must fit in one slab
+    while ((header_end = request.find("\r\n\r\n")) == std::string::npos ||
+           header_end + 4 > BufferPool::SLAB_SIZE) {
+        if (request.size() > BufferPool::SLAB_SIZE) {
+            static const char too_large[] = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                                            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            conn.write(too_large, sizeof(too_large) - 1);
+            return fail();
+        }
+        if ((bytes_read = conn.read()) <= 0)
+            return fail();
+        request.append(conn.buffer.data(), bytes_read);
+    }
+    header_end += 4;
+    // The header deadline covered the whole header block; body reads only have to keep moving
+    conn.phase = Connection::BODY;
+
+    // Chunked bodies are decoded in place so handlers always see the plain body
+    std::string_view headers(request.data(), header_end);
+    std::string_view transfer_encoding = find_raw_header(headers, "Transfer-Encoding");
+    if (!transfer_encoding.empty() && !iequals(transfer_encoding, "identity")) {
+        std::pmr::string pending(request.substr(header_end), request_memory());
+        std::pmr::string body(request_memory());
+        if (!iequals(transfer_encoding, "chunked") || !read_chunked_body(conn, pending, body))
+            return fail();
+        if (!conn.carry_over(pending))
+            return fail();
+        request.resize(header_end);
+        request += body;
+        return request;
+    }
+
+    // Parse headers to find Content-Length
+    size_t content_length = 0;
+    std::string_view content_length_str = find_raw_header(headers, "Content-Length");
+    if (!content_length_str.empty()) {
+        auto [end, ec] = std::from_chars(content_length_str.data(),
+                                         content_length_str.data() + content_length_str.size(),
+                                         content_length);
+        if (ec != std::errc() || content_length > MAX_BODY_SIZE)
+            return fail();
+    }
+
+    // Read the body if Content-Length is specified
+    size_t request_end = header_end + content_length;
+    while (request.size() < request_end) {
+        if ((bytes_read = conn.read()) <= 0)
+            return fail();
+        request.append(conn.buffer.data(), bytes_read);
+    }
+
+    if (!conn.carry_over(std::string_view(request).substr(request_end)))
+        return fail();
+    request.resize(request_end);
+    return request;
+}
+
+// Function to parse the HTTP request. Keys and values are copied into the request arena.
+RequestInfo parse_request(std::string_view request) {
+    RequestInfo request_info(request_memory());
+    auto set = [&](std::string_view key, std::string_view value) {
+        request_info[std::pmr::string(key, request_memory())].assign(value.data(), value.size());
+    };
+    auto next_line = [&request]() {
+        size_t end = request.find('\n');
+        std::string_view line = request.substr(0, end);
+        request.remove_prefix(end == std::string_view::npos ? request.size() : end + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        return line;
+    };
+
+    // Get the request line
+    std::string_view line = next_line();
+    const char *fields[] = {"method", "path", "version"};
+    for (const char *field : fields) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string_view::npos)
+            start = line.size();
+        line.remove_prefix(start);
+        size_t end = std::min(line.find_first_of(" \t"), line.size());
+        set(field, line.substr(0, end));
+        line.remove_prefix(end);
+    }
+
+    // Parse headers
+    while (!request.empty()) {
+        line = next_line();
+        if (line.empty()) {
+            break;
+        }
+        auto colon_pos = line.find(':');
+        if (colon_pos != std::string_view::npos) {
+            set(line.substr(0, colon_pos), trim(line.substr(colon_pos + 1)));
+        }
+    }
+
+    // The rest is the body
+    set("body", request);
+
+    return request_info;
+}
+
+// Function to look up a request header by name (case-insensitive); empty if absent
+std::string_view get_header(const RequestInfo& request_info, std::string_view name) {
+    for (const auto& [key, value] : request_info) {
+        if (iequals(key, name))
+            return value;
+    }
+    return {};
+}
+
+// Streaming response writer. Handlers push the body piece by piece instead of building it in
+// one string: with a known length the pieces go out as-is, otherwise each one is framed as an
+// HTTP/1.1 chunk (HTTP/1.0 clients get a close-delimited body instead). The header block is held
+// back and sent together with the first small piece, so short responses take a single write.
+class ResponseWriter {
+public:
+    ResponseWriter(Connection& conn, bool chunked_ok, bool keep_alive)
+        : conn(conn), chunked_ok(chunked_ok), keep_alive(keep_alive),
+          head(request_memory()), frame(request_memory()) {}
+    void begin(std::string_view status, std::string_view content_type,
+               long long content_length = -1, std::string_view extra_headers = {});
+    bool write(const char *data, size_t len);
+    bool write(std::string_view data) { return write(data.data(), data.size()); }
+    bool end();
+    // Sends an already complete response (status line, headers and body) instead of streaming
+    bool send_raw(std::string_view response);
+    // Gives up on a response that cannot be completed: the connection is closed afterwards
+    // instead of being reused with a body that does not match its headers
+    void abort() { ok = false; }
+    bool started() const { return headers_sent; }
+    bool failed() const { return !ok; }
+    // Whether the connection can carry another request once this response is complete
+    bool reusable() const { return ok && finished && keep_alive; }
+
+private:
+    // Pieces up to this size are copied behind the pending header block instead of being sent
+    // in a write of their own
+    static const size_t COALESCE_LIMIT = 16 * 1024;
+    bool send(const char *data, size_t len);
+    Connection& conn;
+    bool chunked_ok;
+    bool keep_alive;
+    bool chunked = false;
+    bool headers_sent = false;
+    bool finished = false;
+    bool ok = true;
+    bool corked = false;
+    long long content_length = -1;
+    unsigned long long body_written = 0;
+    std::pmr::string head;
+    std::pmr::string frame;
+};
+
+void ResponseWriter::begin(std::string_view status, std::string_view content_type,
+                           long long content_length, std::string_view extra_headers) {
+    if (headers_sent)
+        return;
+    headers_sent = true;
+    head += "HTTP/1.1 ";
+    head += status;
+    head += "\r\n";
+    this->content_length = content_length;
+    if (content_length >= 0) {
+        char length[32];
+        auto result = std::to_chars(length, length + sizeof(length), content_length);
+        head += "Content-Length: ";
+        head.append(length, result.ptr);
+        head += "\r\n";
+    } else if (chunked_ok) {
+        chunked = true;
+        head += "Transfer-Encoding: chunked\r\n";
+    } else {
+        // The end of a close-delimited body is the end of the connection
+        keep_alive = false;
+    }
+    head += "Content-Type: ";
+    head += content_type;
+    head += "\r\n";
+    head += extra_headers;
+    if (!keep_alive)
+        head += "Connection: close\r\n";
+    head += "\r\n";
+}
+
+bool ResponseWriter::write(const char *data, size_t len) {
+    if (!headers_sent)
+        begin("200 OK", "application/octet-stream");
+    if (!ok || finished || len == 0)
+        return ok;
+    body_written += len;
+
+    if (!chunked && (head.empty() || len > COALESCE_LIMIT)) {
+        // Nothing to coalesce with, or too large to copy: send the data as it is. With tcp_cork
+        // the socket stays corked until end(), so the header block and the body share full
+        // segments and the last partial one leaves as soon as the response is complete.
+        if (!head.empty()) {
+            if (conn.listener && conn.listener->tcp_cork) {
+                int one = 1;
+                corked = setsockopt(conn.fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one)) == 0;
+            }
+            send(head.data(), head.size());
+            head.clear();
+        }
+        return send(data, len);
+    }
+
+    frame.clear();
+    if (chunked) {
+        char size_line[20];
+        int n = std::snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+        frame.assign(size_line, n);
+    }
+    frame.append(data, len);
+    if (chunked)
+        frame += "\r\n";
+    if (!head.empty()) {
+        head += frame;
+        send(head.data(), head.size());
+        head.clear();
+        return ok;
+    }
+    return send(frame.data(), frame.size());
+}
+
+bool ResponseWriter::end() {
+    if (!headers_sent)
+        begin("200 OK", "application/octet-stream", 0);
+    // A body that came up short of (or ran past) its Content-Length leaves the client's framing
+    // out of step with the connection, so it must not carry another response
+    if (content_length >= 0 && body_written != static_cast<unsigned long long>(content_length))
+        ok = false;
+    if (chunked && !finished)
+        head += "0\r\n\r\n";
+    if (!head.empty()) {
+        send(head.data(), head.size());
+        head.clear();
+    }
+    if (corked) {
+        int zero = 0;
+        setsockopt(conn.fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+        corked = false;
+    }
+    finished = true;
+    return ok;
+}
+
+bool ResponseWriter::send_raw(std::string_view response) {
+    if (headers_sent)
+        return false;
+    headers_sent = true;
+    finished = true;
+
+    size_t header_end = response.find("\r\n\r\n");
+    if (header_end == std::string_view::npos)
+        return send(response.data(), response.size());
+    if (keep_alive) {
+        // A handler that asked for the connection to be closed gets its way
+        std::string_view headers = response.substr(0, header_end + 2);
+        for_each_token(find_raw_header(headers, "Connection"), [&](std::string_view token) {
+            if (iequals(token, "close"))
+                keep_alive = false;
+            return keep_alive;
+        });
+        return send(response.data(), response.size());
+    }
+    head.assign(response.substr(0, header_end + 2));
+    head += "Connection: close\r\n";
+    head += response.substr(header_end + 2);
+    send(head.data(), head.size());
+    head.clear();
+    return ok;
+}
+
+bool ResponseWriter::send(const char *data, size_t len) {
+    if (ok && len > 0 && !conn.write(data, len))
+        ok = false;
+    return ok;
+}
+
+// Function to get the MIME type based on file extension
+std::string_view get_mime_type(std::string_view path) {
+    if (path.ends_with(".html") || path.ends_with(".htm"))
+        return "text/html";
+    else if (path.ends_with(".css"))
+        return "text/css";
+    else if (path.ends_with(".js"))
+        return "application/javascript";
+    else if (path.ends_with(".json"))
+        return "application/json";
+    else if (path.ends_with(".png"))
+        return "image/png";
+    else if (path.ends_with(".jpg") || path.ends_with(".jpeg"))
+        return "image/jpeg";
+    else if (path.ends_with(".gif"))
+        return "image/gif";
+    else
+        return "application/octet-stream";
+}
+
+// Function to handle 404 Not Found
+std::string not_found_response() {
+    std::string body = "<html><body><h1>404 Not Found</h1></body></html>";
+    std::string response;
+    response = "HTTP/1.1 404 Not Found\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    response += "Content-Type: text/html\r\n";
+    response += "\r\n";
+    response += body;
+    return response;
+}
+
+// Function to handle 500 Internal Server Error
+std::string internal_error_response() {
+    std::string body = "<html><body><h1>500 Internal Server Error</h1></body></html>";
+    std::string response;
+    response = "HTTP/1.1 500 Internal Server Error\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    response += "Content-Type: text/html\r\n";
+    response += "\r\n";
+    response += body;
+    return response;
+}
+
+// Identifies one version of a file on disk; a change in any field means new content
+struct FileVersion {
+    ino_t inode = 0;
+    off_t size = 0;
+    long long mtime_ns = 0;
+    bool operator==(const FileVersion& other) const {
+        return inode == other.inode && size == other.size && mtime_ns == other.mtime_ns;
+    }
+};
+
+// Function to stat a path into a FileVersion; false if it is missing or not a regular file
+bool stat_file(const std::string& path, FileVersion& version) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    version.inode = st.st_ino;
+    version.size = st.st_size;
+    version.mtime_ns = static_cast<long long>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// An open regular file and the version it had when opened. The descriptor is closed when the
+// last holder lets go, so evicting a cache entry never pulls it out from under a request.
+struct OpenFile {
+    int fd = -1;
+    FileVersion version;
+    ~OpenFile() {
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+// Function to read `len` bytes at `offset` of a file and append them to `out`
+bool read_file_range(int fd, off_t offset, size_t len, std::string& out) {
+    size_t start = out.size();
+    out.resize(start + len);
+    while (len > 0) {
+        ssize_t got = pread(fd, out.data() + out.size() - len, len, offset);
+        if (got <= 0) {
+            out.resize(start);
+            return false;
+        }
+        len -= got;
+        offset += got;
+    }
+    return true;
+}
+
+// Open File Cache: open descriptors plus their stat results, and negative entries for paths
+// that are missing or not regular files, so repeated hits and repeated 404s skip the
+// filesystem. Entries are revalidated with a single stat() once older than the TTL. The table
+// is split into independently locked LRU shards, and the number of cached descriptors is kept
+// well under RLIMIT_NOFILE so connections never starve for fds.
+class OpenFileCache {
+public:
+    void configure(size_t max_entries, std::chrono::milliseconds ttl);
+    // Returns the open file, or nullptr when the path does not name a readable regular file
+    std::shared_ptr<const OpenFile> open(std::string_view path);
+    void invalidate(std::string_view path);
+    void clear();
+
+private:
+    static const size_t SHARDS = 16;
+    struct Entry {
+        std::string path;
+        std::shared_ptr<const OpenFile> file;  // nullptr for a negative entry
+        std::chrono::steady_clock::time_point checked;
+    };
+    struct Shard {
+        std::list<Entry> lru;
+        std::unordered_map<std::string, std::list<Entry>::iterator, StringHash, std::equal_to<>> index;
+        size_t open_fds = 0;
+        std::mutex mutex;
+    };
+    void insert_locked(Shard& shard, Entry entry);
+    void evict_locked(Shard& shard, size_t max_entries, size_t max_fds);
+    Shard shards[SHARDS];
+    std::atomic<size_t> shard_entries{64};
+    std::atomic<size_t> shard_fds{64};
+    std::atomic<long long> ttl_ms{1000};
+};
+
+void OpenFileCache::configure(size_t max_entries, std::chrono::milliseconds new_ttl) {
+    // Leave at least three quarters of the descriptor limit to sockets and everything else
+    rlimit limit{};
+    size_t fd_budget = max_entries;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        fd_budget = std::min<size_t>(fd_budget, limit.rlim_cur / 4);
+    shard_entries = std::max<size_t>(1, max_entries / SHARDS);
+    shard_fds = std::max<size_t>(1, fd_budget / SHARDS);
+    ttl_ms = new_ttl.count();
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        evict_locked(shard, shard_entries, shard_fds);
+    }
+}
+
+std::shared_ptr<const OpenFile> OpenFileCache::open(std::string_view path) {
+    Shard& shard = shards[StringHash{}(path) % SHARDS];
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<const OpenFile> previous;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(path);
+        if (it != shard.index.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+            if (now - it->second->checked < std::chrono::milliseconds(ttl_ms.load())) {
+                if (it->second->file) {
+                    metrics.open_file_cache_hits++;
+                } else {
+                    metrics.open_file_cache_negative_hits++;
+                }
+                return it->second->file;
+            }
+            previous = it->second->file;
+        }
+    }
+    metrics.open_file_cache_misses++;
+
+    // Revalidate: an unchanged file keeps its descriptor, anything else is reopened
+    std::string key(path);
+    FileVersion version;
+    std::shared_ptr<const OpenFile> file;
+    if (stat_file(key, version)) {
+        if (previous && previous->version == version) {
+            file = previous;
+        } else {
+            int fd = ::open(key.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+                // Out of descriptors: drop this shard's cached ones and retry once
+                {
+                    std::lock_guard<std::mutex> lock(shard.mutex);
+                    evict_locked(shard, shard_entries, 0);
+                }
+                fd = ::open(key.c_str(), O_RDONLY | O_CLOEXEC);
+            }
+            if (fd >= 0) {
+                auto opened = std::make_shared<OpenFile>();
+                opened->fd = fd;
+                struct stat st;
+                if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                    version.inode = st.st_ino;
+                    version.size = st.st_size;
+                    version.mtime_ns = static_cast<long long>(st.st_mtim.tv_sec) * 1000000000LL +
+                                       st.st_mtim.tv_nsec;
+                    opened->version = version;
+                    file = opened;
+                }
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    insert_locked(shard, Entry{std::move(key), file, now});
+    return file;
+}
+
+void OpenFileCache::invalidate(std::string_view path) {
+    Shard& shard = shards[StringHash{}(path) % SHARDS];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(path);
+    if (it == shard.index.end())
+        return;
+    if (it->second->file)
+        shard.open_fds--;
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+}
+
+void OpenFileCache::clear() {
+    for (auto& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.lru.clear();
+        shard.index.clear();
+        shard.open_fds = 0;
+    }
+}
+
+void OpenFileCache::insert_locked(Shard& shard, Entry entry) {
+    auto it = shard.index.find(entry.path);
+    if (it != shard.index.end()) {
+        if (it->second->file)
+            shard.open_fds--;
+        shard.lru.erase(it->second);
+        shard.index.erase(it);
+    }
+    if (entry.file)
+        shard.open_fds++;
+    shard.lru.push_front(std::move(entry));
+    shard.index[shard.lru.front().path] = shard.lru.begin();
+    evict_locked(shard, shard_entries, shard_fds);
+}
+
+void OpenFileCache::evict_locked(Shard& shard, size_t max_entries, size_t max_fds) {
+    auto it = shard.lru.end();
+    while (it != shard.lru.begin() && (shard.lru.size() > max_entries || shard.open_fds > max_fds)) {
+        --it;
+        // Over the fd budget only entries holding a descriptor need to go
+        if (shard.lru.size() <= max_entries && !it->file)
+            continue;
+        if (it->file)
+            shard.open_fds--;
+        shard.index.erase(it->path);
+        it = shard.lru.erase(it);
+    }
+}
+
+OpenFileCache open_file_cache;
+
+// Body Cache: file bodies kept in LRU order and bounded by their total size. Entries remember
+// the file version they were built from, so an edited file is rebuilt once and then served from
+// memory again. One instance holds compressed variants (keyed by encoding and path), another
+// the raw contents of small files.
+class BodyCache {
+public:
+    void set_capacity(size_t bytes);
+    std::shared_ptr<const std::string> get(std::string_view key, const FileVersion& version);
+    void put(std::string_view key, const FileVersion& version,
+             std::shared_ptr<const std::string> data);
+    void invalidate(std::string_view key);
+    void clear();
+
+private:
+    struct Entry {
+        std::string key;
+        FileVersion version;
+        std::shared_ptr<const std::string> data;
+    };
+    using Index = std::unordered_map<std::string, std::list<Entry>::iterator, StringHash, std::equal_to<>>;
+    void erase_locked(Index::iterator it);
+    void evict_locked();
+    std::list<Entry> lru;
+    Index index;
+    size_t capacity = 0;
+    size_t used = 0;
+    std::mutex mutex;
+};
+
+void BodyCache::set_capacity(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = bytes;
+    evict_locked();
+}
+
+std::shared_ptr<const std::string> BodyCache::get(std::string_view key, const FileVersion& version) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it == index.end())
+        return nullptr;
+    if (!(it->second->version == version)) {
+        erase_locked(it);
+        return nullptr;
+    }
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->data;
+}
+
+void BodyCache::put(std::string_view key, const FileVersion& version,
+                    std::shared_ptr<const std::string> data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (data->size() > capacity)
+        return;
+    auto it = index.find(key);
+    if (it != index.end())
+        erase_locked(it);
+    used += data->size();
+    lru.push_front(Entry{std::string(key), version, std::move(data)});
+    index[lru.front().key] = lru.begin();
+    evict_locked();
+}
+
+void BodyCache::invalidate(std::string_view key) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it != index.end())
+        erase_locked(it);
+}
+
+void BodyCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    lru.clear();
+    index.clear();
+    used = 0;
+}
+
+void BodyCache::erase_locked(Index::iterator it) {
+    used -= it->second->data->size();
+    lru.erase(it->second);
+    index.erase(it);
+}
+
+void BodyCache::evict_locked() {
+    while (used > capacity && !lru.empty()) {
+        used -= lru.back().data->size();
+        index.erase(lru.back().key);
+        lru.pop_back();
+    }
+}
+
+BodyCache variant_cache;
+BodyCache content_cache;
+
+// Function to get the body of a small file from the content cache, reading it on a miss
+std::shared_ptr<const std::string> cached_body(std::string_view path, const OpenFile& file) {
+    if (auto cached = content_cache.get(path, file.version)) {
+        metrics.content_cache_hits++;
+        return cached;
+    }
+    metrics.content_cache_misses++;
+    auto body = std::make_shared<std::string>();
+    if (!read_file_range(file.fd, 0, file.version.size, *body))
+        return nullptr;
+    content_cache.put(path, file.version, body);
+    return body;
+}
+
+// Function to gzip a buffer; false on failure
+bool gzip_compress(const std::string& input, std::string& output) {
+    z_stream stream{};
+    // windowBits 15 + 16 selects the gzip wrapper instead of raw zlib
+    if (deflateInit2(&stream, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    output.resize(deflateBound(&stream, input.size()));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = input.size();
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = output.size();
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+// Function to brotli-compress a buffer; false on failure
+bool brotli_compress(const std::string& input, std::string& output) {
+    size_t output_size = BrotliEncoderMaxCompressedSize(input.size());
+    if (output_size == 0)
+        return false;
+    output.resize(output_size);
+    if (!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               input.size(), reinterpret_cast<const uint8_t*>(input.data()),
+                               &output_size, reinterpret_cast<uint8_t*>(output.data())))
+        return false;
+    output.resize(output_size);
+    return true;
+}
+
+// Function to check whether responses of a MIME type are worth compressing
+bool is_compressible(std::string_view content_type) {
+    auto types = COMPRESSIBLE_TYPES.get();
+    for (const auto& type : *types) {
+        if (content_type == type)
+            return true;
+    }
+    return false;
+}
+
+// Encodings a client accepts, most preferred first ("br", then "gzip")
+struct AcceptedEncodings {
+    std::string_view list[2];
+    size_t count = 0;
+    const std::string_view* begin() const { return list; }
+    const std::string_view* end() const { return list + count; }
+};
+
+// Function to parse Accept-Encoding into the encodings the server can produce
+AcceptedEncodings accepted_encodings(std::string_view accept_encoding) {
+    bool br = false, gzip = false;
+    for_each_token(accept_encoding, [&](std::string_view token) {
+        std::string_view coding = trim(token.substr(0, token.find(';')));
+
+        // A q-value of zero explicitly refuses the coding
+        bool refused = false;
+        size_t q_pos = token.find("q=");
+        if (q_pos != std::string_view::npos) {
+            std::string_view q = trim(token.substr(q_pos + 2));
+            refused = q.find_first_not_of("0.") == std::string_view::npos;
+        }
+
+        if (coding == "br" || coding == "*")
+            br = br || !refused;
+        if (coding == "gzip" || coding == "x-gzip" || coding == "*")
+            gzip = gzip || !refused;
+        return true;
+    });
+    AcceptedEncodings encodings;
+    if (br) encodings.list[encodings.count++] = "br";
+    if (gzip) encodings.list[encodings.count++] = "gzip";
+    return encodings;
+}
+
+// Function to fetch (or build and cache) the compressed variant of a file
+std::shared_ptr<const std::string> compressed_variant(std::string_view full_path,
+                                                      const OpenFile& file,
+                                                      std::string_view encoding) {
+    std::pmr::string key(encoding, request_memory());
+    key += ":";
+    key += full_path;
+    if (auto cached = variant_cache.get(key, file.version)) {
+        metrics.compression_cache_hits++;
+        return cached;
+    }
+    metrics.compression_cache_misses++;
+
+    std::string body;
+    if (!read_file_range(file.fd, 0, file.version.size, body))
+        return nullptr;
+
+    auto compressed = std::make_shared<std::string>();
+    bool ok = encoding == "br" ? brotli_compress(body, *compressed) : gzip_compress(body, *compressed);
+    if (!ok)
+        return nullptr;
+    variant_cache.put(key, file.version, compressed);
+    return compressed;
+}
+
+// File Metadata Table: validators (ETag, Last-Modified) per file, formatted once per file version
+// so conditional requests are answered from memory without opening the file.
+struct FileMetadata {
+    FileVersion version;
+    std::string etag;           // opaque tag without quotes or encoding suffix
+    std::string quoted_etag;    // ETag header value of the unencoded file
+    std::string last_modified;  // HTTP-date
+    std::time_t mtime = 0;
+};
+
+class FileMetadataTable {
+public:
+    std::shared_ptr<const FileMetadata> lookup(std::string_view path, const FileVersion& version);
+    void invalidate(std::string_view path);
+    void clear();
+
+private:
+    std::unordered_map<std::string, std::shared_ptr<const FileMetadata>, StringHash, std::equal_to<>> entries;
+    std::shared_mutex mutex;
+};
+
+std::shared_ptr<const FileMetadata> FileMetadataTable::lookup(std::string_view path,
+                                                              const FileVersion& version) {
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = entries.find(path);
+        if (it != entries.end() && it->second->version == version)
+            return it->second;
+    }
+
+    auto metadata = std::make_shared<FileMetadata>();
+    metadata->version = version;
+    metadata->mtime = static_cast<std::time_t>(version.mtime_ns / 1000000000LL);
+    char tag[64];
+    std::snprintf(tag, sizeof(tag), "%llx-%llx-%llx",
+                  static_cast<unsigned long long>(version.inode),
+                  static_cast<unsigned long long>(version.size),
+                  static_cast<unsigned long long>(version.mtime_ns));
+    metadata->etag = tag;
+    metadata->quoted_etag = "\"" + metadata->etag + "\"";
+    char date[64];
+    std::tm tm{};
+    gmtime_r(&metadata->mtime, &tm);
+    std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    metadata->last_modified = date;
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end())
+        it->second = metadata;
+    else
+        entries.emplace(std::string(path), metadata);
+    return metadata;
+}
+
+void FileMetadataTable::invalidate(std::string_view path) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto it = entries.find(path);
+    if (it != entries.end())
+        entries.erase(it);
+}
+
+void FileMetadataTable::clear() {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    entries.clear();
+}
+
+FileMetadataTable file_metadata;
+
+// Function to format the ETag header value of an encoded file representation. A precompressed
+// sibling can be replaced on its own, so its version (size and mtime) is part of the tag.
+std::string format_etag(const FileMetadata& metadata, std::string_view encoding,
+                        const FileVersion *sibling = nullptr) {
+    std::string etag = "\"" + metadata.etag + "-" + std::string(encoding);
+    if (sibling) {
+        char tag[48];
+        std::snprintf(tag, sizeof(tag), "-%llx-%llx", static_cast<unsigned long long>(sibling->size),
+                      static_cast<unsigned long long>(sibling->mtime_ns));
+        etag += tag;
+    }
+    return etag + "\"";
+}
+
+// Function to check If-None-Match / If-Modified-Since against a file's validators. Any encoded
+// representation of the same file version counts as a match, except one read from a
+// precompressed sibling: that tag only matches `sibling_etag`, the sibling about to be served.
+bool not_modified(const RequestInfo& request_info, const FileMetadata& metadata,
+                  std::string_view sibling_etag = {}) {
+    std::string_view if_none_match = get_header(request_info, "If-None-Match");
+    if (!if_none_match.empty()) {
+        bool match = false;
+        std::string_view etag = metadata.etag;
+        for_each_token(if_none_match, [&](std::string_view tag) {
+            if (tag == "*")
+                return !(match = true);
+            if (tag.starts_with("W/"))
+                tag.remove_prefix(2);
+            if (!sibling_etag.empty() && tag == sibling_etag)
+                return !(match = true);
+            if (tag.size() < 2 || tag.front() != '"' || tag.back() != '"')
+                return true;
+            tag = tag.substr(1, tag.size() - 2);
+            if (tag.starts_with(etag)) {
+                std::string_view suffix = tag.substr(etag.size());
+                match = suffix.empty() || suffix == "-gzip" || suffix == "-br";
+            }
+            return !match;
+        });
+        // If-Modified-Since is ignored whenever If-None-Match is present
+        return match;
+    }
+
+    std::string_view if_modified_since = get_header(request_info, "If-Modified-Since");
+    if (!if_modified_since.empty()) {
+        std::pmr::string date(if_modified_since, request_memory());
+        std::tm tm{};
+        if (strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) != nullptr)
+            return metadata.mtime <= timegm(&tm);
+    }
+    return false;
+}
+
+// Function to build a 304 Not Modified response carrying the file's validators, or `etag` in
+// place of the file's own tag when given
+std::string not_modified_response(const FileMetadata& metadata, std::string_view extra_headers,
+                                  std::string_view etag = {}) {
+    std::string response = "HTTP/1.1 304 Not Modified\r\n";
+    response += "ETag: ";
+    response += etag.empty() ? std::string_view(metadata.quoted_etag) : etag;
+    response += "\r\n";
+    response += "Last-Modified: " + metadata.last_modified + "\r\n";
+    response += extra_headers;
+    response += "\r\n";
+    return response;
+}
+
+// Files larger than this are streamed from disk instead of being read into memory
+const std::uintmax_t STREAM_THRESHOLD = 256 * 1024;
+
+// Byte range of a file, inclusive of both ends
+struct ByteRange {
+    off_t first;
+    off_t last;
+};
+
+// Requests asking for more ranges than this are answered with the whole file
+const size_t MAX_RANGES = 16;
+
+// Function to parse a "bytes=" Range header against the file size. Returns false when the header
+// must be ignored (malformed, other units, too many ranges); otherwise `ranges` holds the
+// satisfiable ranges, which may be none.
+bool parse_range_header(std::string_view header, off_t size, std::vector<ByteRange>& ranges) {
+    if (!header.starts_with("bytes="))
+        return false;
+    size_t count = 0;
+    bool valid = true;
+    for_each_token(header.substr(6), [&](std::string_view spec) {
+        size_t dash = spec.find('-');
+        if (++count > MAX_RANGES || dash == std::string_view::npos)
+            return valid = false;
+
+        long long first = -1, last = -1;
+        const char *begin = spec.data(), *mid = begin + dash, *end = begin + spec.size();
+        if (dash > 0 && std::from_chars(begin, mid, first).ptr != mid)
+            return valid = false;
+        if (mid + 1 < end && std::from_chars(mid + 1, end, last).ptr != end)
+            return valid = false;
+
+        if (first < 0) {
+            // Suffix range: the last N bytes. "-0" is well-formed but selects nothing, so it
+            // leaves the range unsatisfiable rather than the header invalid.
+            if (last < 0)
+                return valid = false;
+            if (size > 0 && last > 0)
+                ranges.push_back({std::max<off_t>(0, size - last), size - 1});
+        } else {
+            if (last >= 0 && last < first)
+                return valid = false;
+            if (first < size)
+                ranges.push_back({first, (last < 0 || last >= size) ? size - 1 : last});
+        }
+        return true;
+    });
+    return valid && count > 0;
+}
+
+// Function to check If-Range: the range applies only if the validator still matches exactly
+bool if_range_matches(const RequestInfo& request_info, const FileMetadata& metadata) {
+    std::string_view if_range = get_header(request_info, "If-Range");
+    if (if_range.empty())
+        return true;
+    if (if_range.front() == '"' || if_range.starts_with("W/"))
+        return if_range == metadata.quoted_etag;
+    return if_range == metadata.last_modified;
+}
+
+// Function to send byte ranges of a file with 206 Partial Content (multipart/byteranges when
+// there are several). Ranges are read with pread, so only the requested bytes are touched;
+// large results are streamed through the writer.
+std::string serve_ranges(const OpenFile& file, std::string_view content_type,
+                         const FileMetadata& metadata, const std::vector<ByteRange>& ranges,
+                         std::string_view extra_headers, ResponseWriter *writer) {
+    off_t size = metadata.version.size;
+    if (ranges.empty()) {
+        std::string response = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+        response += "Content-Range: bytes */" + std::to_string(size) + "\r\n";
+        response += "Content-Length: 0\r\n";
+        response += extra_headers;
+        response += "\r\n";
+        return response;
+    }
+
+    auto content_range = [size](const ByteRange& range) {
+        return "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" +
+               std::to_string(size);
+    };
+
+    // Part headers for multipart responses, computed up front to know the total length
+    const std::string boundary = "range_boundary_" + metadata.etag;
+    std::vector<std::string> part_headers;
+    long long total_length = 0;
+    for (const auto& range : ranges) {
+        if (ranges.size() > 1) {
+            part_headers.push_back("\r\n--" + boundary + "\r\nContent-Type: " +
+                                   std::string(content_type) + "\r\nContent-Range: " +
+                                   content_range(range) + "\r\n\r\n");
+            total_length += part_headers.back().size();
+        }
+        total_length += range.last - range.first + 1;
+    }
+    const std::string closing = "\r\n--" + boundary + "--\r\n";
+    if (ranges.size() > 1)
+        total_length += closing.size();
+
+    std::string response_type = ranges.size() > 1 ? "multipart/byteranges; boundary=" + boundary
+                                                   : std::string(content_type);
+    std::string headers(extra_headers);
+    if (ranges.size() == 1)
+        headers += "Content-Range: " + content_range(ranges[0]) + "\r\n";
+
+    std::string response;
+    bool streaming = writer && total_length > static_cast<long long>(STREAM_THRESHOLD);
+    auto emit = [&](const char *data, size_t len) {
+        if (streaming)
+            return writer->write(data, len);
+        response.append(data, len);
+        return true;
+    };
+
+    if (streaming) {
+        writer->begin("206 Partial Content", response_type, total_length, headers);
+    } else {
+        response = "HTTP/1.1 206 Partial Content\r\n";
+        response += "Content-Length: " + std::to_string(total_length) + "\r\n";
+        response += "Content-Type: " + response_type + "\r\n";
+        response += headers;
+        response += "\r\n";
+        response.reserve(response.size() + total_length);
+    }
+
+    char buffer[16384];
+    bool ok = true;
+    for (size_t i = 0; i < ranges.size() && ok; ++i) {
+        if (ranges.size() > 1)
+            ok = emit(part_headers[i].data(), part_headers[i].size());
+        off_t offset = ranges[i].first;
+        while (ok && offset <= ranges[i].last) {
+            size_t want = std::min<off_t>(sizeof(buffer), ranges[i].last - offset + 1);
+            ssize_t got = pread(file.fd, buffer, want, offset);
+            if (got <= 0) {
+                ok = false;
+                break;
+            }
+            ok = emit(buffer, got);
+            offset += got;
+        }
+    }
+    if (ok && ranges.size() > 1)
+        ok = emit(closing.data(), closing.size());
+
+    // The file was just stat'ed, so a failed read is a server error rather than a missing file.
+    // Once streaming has started the status is out, so the connection is given up instead.
+    if (!ok && !streaming)
+        return internal_error_response();
+    if (!ok)
+        writer->abort();
+    if (ok)
+        metrics.partial_responses++;
+    return response;
+}
+
+// Function to serve a file from disk through the open file cache. Conditional requests that
+// still match the file's ETag or Last-Modified get a 304 without the body being read, and Range
+// requests get just the requested bytes of the unencoded file. Compressible types are sent
+// gzip/brotli encoded when the client accepts it, preferring a precompressed ".br"/".gz" sibling
+// over compressing on the fly. When a writer is given the response goes through it: cached
+// bodies are written straight from the cache, and files above STREAM_THRESHOLD are pushed in
+// fixed-size pieces so memory use stays flat regardless of file size.
+std::string serve_file(std::string_view full_path, const RequestInfo& request_info,
+                       ResponseWriter *writer = nullptr) {
+    auto file = open_file_cache.open(full_path);
+    if (!file)
+        return not_found_response();
+    const FileVersion& version = file->version;
+
+    std::string_view content_type = get_mime_type(full_path);
+    auto body_file = file;
+    std::pmr::string body_path(full_path, request_memory());
+    std::pmr::string headers(request_memory());
+    bool compressible = is_compressible(content_type);
+    if (compressible)
+        headers += "Vary: Accept-Encoding\r\n";
+
+    auto metadata = file_metadata.lookup(full_path, version);
+    if (not_modified(request_info, *metadata)) {
+        metrics.not_modified_responses++;
+        return not_modified_response(*metadata, headers);
+    }
+    auto add_validators = [&](std::string_view etag) {
+        headers += "ETag: ";
+        headers += etag;
+        headers += "\r\nLast-Modified: ";
+        headers += metadata->last_modified;
+        headers += "\r\nAccept-Ranges: bytes\r\n";
+    };
+
+    // Function to send a complete in-memory body, through the writer when possible
+    auto send_body = [&](std::string_view body) {
+        if (writer) {
+            writer->begin("200 OK", content_type, body.size(), headers);
+            writer->write(body);
+            return std::string();
+        }
+        std::string response = "HTTP/1.1 200 OK\r\n";
+        response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        response += "Content-Type: ";
+        response += content_type;
+        response += "\r\n";
+        response += headers;
+        response += "\r\n";
+        response += body;
+        return response;
+    };
+
+    std::string_view range_header = get_header(request_info, "Range");
+    if (!range_header.empty()) {
+        std::vector<ByteRange> ranges;
+        if (if_range_matches(request_info, *metadata) &&
+            parse_range_header(range_header, version.size, ranges)) {
+            add_validators(metadata->quoted_etag);
+            return serve_ranges(*file, content_type, *metadata, ranges, headers, writer);
+        }
+    }
+
+    if (compressible) {
+        for (std::string_view encoding : accepted_encodings(get_header(request_info, "Accept-Encoding"))) {
+            body_path.resize(full_path.size());
+            body_path += (encoding == "br" ? ".br" : ".gz");
+            auto sibling = open_file_cache.open(body_path);
+            if (sibling) {
+                std::string etag = format_etag(*metadata, encoding, &sibling->version);
+                if (not_modified(request_info, *metadata, etag)) {
+                    metrics.not_modified_responses++;
+                    return not_modified_response(*metadata, headers, etag);
+                }
+                body_file = sibling;
+                add_validators(etag);
+                headers += "Content-Encoding: ";
+                headers += encoding;
+                headers += "\r\n";
+                metrics.compressed_responses++;
+                metrics.compression_bytes_in += version.size;
+                metrics.compression_bytes_out += sibling->version.size;
+                break;
+            }
+            body_path.resize(full_path.size());
+            if (static_cast<size_t>(version.size) < COMPRESSION_MIN_SIZE ||
+                static_cast<size_t>(version.size) > COMPRESSION_MAX_SIZE)
+                continue;
+            auto compressed = compressed_variant(full_path, *file, encoding);
+            if (!compressed || compressed->size() >= static_cast<size_t>(version.size))
+                continue;
+
+            metrics.compressed_responses++;
+            metrics.compression_bytes_in += version.size;
+            metrics.compression_bytes_out += compressed->size();
+            add_validators(format_etag(*metadata, encoding));
+            headers += "Content-Encoding: ";
+            headers += encoding;
+            headers += "\r\n";
+            return send_body(*compressed);
+        }
+    }
+
+    if (body_file == file)
+        add_validators(metadata->quoted_etag);
+    off_t file_size = body_file->version.size;
+
+    // Serve the file
+    if (writer && static_cast<std::uintmax_t>(file_size) > STREAM_THRESHOLD) {
+        writer->begin("200 OK", content_type, file_size, headers);
+        char buffer[16384];
+        off_t offset = 0;
+        while (offset < file_size && !writer->failed()) {
+            size_t want = std::min<off_t>(sizeof(buffer), file_size - offset);
+            ssize_t got = pread(body_file->fd, buffer, want, offset);
+            if (got <= 0) {
+                // The file shrank or broke after the cached stat: the promised length can't be met
+                writer->abort();
+                break;
+            }
+            writer->write(buffer, got);
+            offset += got;
+        }
+        return "";
+    }
+
+    if (static_cast<size_t>(file_size) <= CONTENT_CACHE_MAX_FILE_SIZE) {
+        auto body = cached_body(body_path, *body_file);
+        if (!body)
+            return not_found_response();
+        return send_body(*body);
+    }
+    std::string body;
+    if (!read_file_range(body_file->fd, 0, file_size, body))
+        return not_found_response();
+    return send_body(body);
+}
+
+// Function to drop every cached view of one file
+void invalidate_cached_file(const std::string& path) {
+    open_file_cache.invalidate(path);
+    content_cache.invalidate(path);
+    variant_cache.invalidate("br:" + path);
+    variant_cache.invalidate("gzip:" + path);
+    file_metadata.invalidate(path);
+}
+
+// Function to drop all cached files, for changes too broad to track path by path
+void clear_file_caches() {
+    open_file_cache.clear();
+    content_cache.clear();
+    variant_cache.clear();
+    file_metadata.clear();
+}
+
+// Function to load one file into the open file, metadata and content caches
+bool preload_file(const std::string& path) {
+    auto file = open_file_cache.open(path);
+    if (!file || static_cast<size_t>(file->version.size) > CONTENT_CACHE_MAX_FILE_SIZE)
+        return false;
+    file_metadata.lookup(path, file->version);
+    return cached_body(path, *file) != nullptr;
+}
+
+// Function to warm the caches with every small file under the web root. The files are read by
+// several threads, since the walk is dominated by open/read latency rather than CPU.
+void preload_web_root(const std::string& root) {
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::string> paths;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(root, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec))
+            paths.push_back(it->path().string());
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> loaded{0};
+    size_t num_threads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), paths.size());
+    std::vector<std::thread> loaders;
+    for (size_t i = 0; i < num_threads; ++i) {
+        loaders.emplace_back([&] {
+            for (size_t n; (n = next++) < paths.size();) {
+                if (preload_file(paths[n]))
+                    loaded++;
+            }
+        });
+    }
+    for (auto& loader : loaders)
+        loader.join();
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started);
+    log("Preloaded " + std::to_string(loaded.load()) + " of " + std::to_string(paths.size()) +
+        " files from " + root + " in " + std::to_string(elapsed.count()) + " ms");
+}
+
+// Web Root Watcher: follows the web root recursively with inotify and drops exactly the cache
+// entries of files that change, reloading their contents when preloading is on. Directory-level
+// changes and event queue overflows, which can touch many paths at once, clear the caches.
+class WebRootWatcher {
+public:
+    bool start(const std::string& root);
+    void stop();
+
+private:
+    void run();
+    void watch_tree(const std::string& dir);
+    void handle_event(const inotify_event& event);
+    int inotify_fd = -1;
+    int stop_fd = -1;
+    std::unordered_map<int, std::string> directories;
+    std::thread thread;
+};
+
+bool WebRootWatcher::start(const std::string& root) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (inotify_fd < 0 || stop_fd < 0) {
+        log("inotify unavailable; web root changes are picked up by cache TTL only");
+        return false;
+    }
+    watch_tree(root);
+    thread = std::thread([this] { run(); });
+    log("Watching " + std::to_string(directories.size()) + " directories under " + root);
+    return true;
+}
+
+void WebRootWatcher::stop() {
+    if (!thread.joinable())
+        return;
+    uint64_t one = 1;
+    if (::write(stop_fd, &one, sizeof(one)) < 0)
+        log("Failed to signal the web root watcher.");
+    thread.join();
+    close(inotify_fd);
+    close(stop_fd);
+    directories.clear();
+}
+
+void WebRootWatcher::watch_tree(const std::string& dir) {
+    const uint32_t mask = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR;
+    int wd = inotify_add_watch(inotify_fd, dir.c_str(), mask);
+    if (wd < 0) {
+        log("Failed to watch " + dir);
+        return;
+    }
+    directories[wd] = dir;
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ec) && !it->is_symlink(ec))
+            watch_tree(dir + "/" + it->path().filename().string());
+    }
+}
+
+void WebRootWatcher::run() {
+    alignas(inotify_event) char buffer[16384];
+    pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        ssize_t len;
+        while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char *ptr = buffer; ptr < buffer + len;) {
+                auto *event = reinterpret_cast<inotify_event*>(ptr);
+                handle_event(*event);
+                ptr += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+}
+
+void WebRootWatcher::handle_event(const inotify_event& event) {
+    metrics.watcher_invalidations++;
+    if (event.mask & IN_Q_OVERFLOW) {
+        log("inotify queue overflowed; clearing file caches");
+        clear_file_caches();
+        return;
+    }
+    auto dir = directories.find(event.wd);
+    if (dir == directories.end())
+        return;
+
+    if (event.mask & (IN_DELETE_SELF | IN_IGNORED)) {
+        directories.erase(dir);
+        return;
+    }
+    std::string path = dir->second + "/" + (event.len ? event.name : "");
+
+    if (event.mask & IN_ISDIR) {
+        // A whole subtree appeared or vanished: watch new directories, forget all cached paths
+        if (event.mask & (IN_CREATE | IN_MOVED_TO))
+            watch_tree(path);
+        if (event.mask & (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE))
+            clear_file_caches();
+        return;
+    }
+
+    invalidate_cached_file(path);
+    if (PRELOAD_WEB_ROOT && (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+        preload_file(path);
+}
+
+WebRootWatcher web_root_watcher;
+
+// Coroutine Handlers. A task<T> is a coroutine that starts when it is first co_awaited and hands
+// its result (or exception) back to the awaiting coroutine. Tasks run on the EventLoop thread:
+// waiting for a socket, a timer or a file read suspends only the coroutine, so any number of
+// slow handlers share that one thread instead of each holding a worker.
+template <class T = void>
+class task;
+
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr exception;
+
+    // On completion, control goes straight back to the awaiting coroutine
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <class Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+};
+
+template <class T>
+struct TaskPromise : TaskPromiseBase {
+    std::optional<T> value;
+    task<T> get_return_object();
+    template <class U>
+    void return_value(U&& result) { value.emplace(std::forward<U>(result)); }
+    T result() {
+        if (exception)
+            std::rethrow_exception(exception);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+    task<void> get_return_object();
+    void return_void() {}
+    void result() {
+        if (exception)
+            std::rethrow_exception(exception);
+    }
+};
+
+template <class T>
+class task {
+public:
+    using promise_type = TaskPromise<T>;
+    explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    task(task&& other) noexcept : handle(std::exchange(other.handle, {})) {}
+    task& operator=(task&&) = delete;
+    ~task() {
+        if (handle)
+            handle.destroy();
+    }
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <class T>
+task<T> TaskPromise<T>::get_return_object() {
+    return task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline task<void> TaskPromise<void>::get_return_object() {
+    return task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Response produced by a coroutine handler
+struct Response {
+    std::string status = "200 OK";
+    std::string content_type = "text/html";
+    std::string headers;   // extra header lines, each ending in "\r\n"
+    std::string body;
+};
+
+// Request as seen by a coroutine handler. It is a copy, since the handler outlives the request
+// arena the parsed request lives in.
+using AsyncRequest = std::unordered_map<std::string, std::string>;
+
+// Event Loop: one epoll thread that resumes coroutines when their socket is ready or their
+// timer is due, plus FILE_THREADS threads for blocking work such as file reads (epoll cannot
+// wait for regular files). Awaitables must be used from coroutines running on the loop.
+class EventLoop {
+public:
+    static const int FILE_THREADS = 2;
+    static constexpr auto NO_TIMEOUT = std::chrono::milliseconds::max();
+
+    // Suspends until `fd` reports `events` or the timeout passes (fd < 0: only the timeout);
+    // co_await yields true if the fd became ready
+    struct Wait {
+        EventLoop& loop;
+        int fd;
+        uint32_t events;
+        std::chrono::milliseconds timeout;
+        std::coroutine_handle<> handle;
+        bool ready = false;
+        std::multimap<std::chrono::steady_clock::time_point, Wait*>::iterator timer;
+        bool has_timer = false;
+
+        Wait(EventLoop& loop, int fd, uint32_t events, std::chrono::milliseconds timeout)
+            : loop(loop), fd(fd), events(events), timeout(timeout) {}
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> caller) {
+            handle = caller;
+            return loop.add(this);
+        }
+        bool await_resume() const noexcept { return ready; }
+    };
+
+    // Runs `fn` on a file thread and resumes with its result on the loop
+    template <class F>
+    struct Offload {
+        EventLoop& loop;
+        F fn;
+        std::optional<std::invoke_result_t<F&>> result;
+
+        Offload(EventLoop& loop, F fn) : loop(loop), fn(std::move(fn)) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> caller) {
+            loop.submit([this, caller] {
+                result.emplace(fn());
+                loop.post(caller);
+            });
+        }
+        auto await_resume() { return std::move(*result); }
+    };
+
+    // Resumes the awaiting coroutine on the loop thread
+    struct Schedule {
+        EventLoop& loop;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> caller) { loop.post(caller); }
+        void await_resume() const noexcept {}
+    };
+
+    void start(ThreadPool *pool);
+    void stop();
+    // Starts `work` on the loop without waiting for it; may be called from any thread.
+    // Background work (health checks) is not counted as an in-flight handler.
+    void spawn(task<> work, bool background = false);
+    Wait sleep_for(std::chrono::milliseconds duration) { return Wait(*this, -1, 0, duration); }
+    Wait wait_io(int fd, uint32_t events, std::chrono::milliseconds timeout = NO_TIMEOUT) {
+        return Wait(*this, fd, events, timeout);
+    }
+    template <class F>
+    Offload<F> offload(F fn) { return Offload<F>(*this, std::move(fn)); }
+    Schedule schedule() { return {*this}; }
+    ThreadPool& pool() { return *thread_pool; }
+    size_t in_flight() const { return running; }
+    // Resumes `handle` on the loop thread; may be called from any thread
+    void post(std::coroutine_handle<> handle);
+    // Changes the events a pending wait is for (loop thread only)
+    void rearm(Wait *wait, uint32_t events);
+
+private:
+    bool add(Wait *wait);
+    void submit(std::function<void()> job);
+    void run();
+    void run_files();
+    ThreadPool *thread_pool = nullptr;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::multimap<std::chrono::steady_clock::time_point, Wait*> timers;
+    std::atomic<size_t> running{0};
+    std::mutex mutex;
+    std::vector<std::coroutine_handle<>> posted;
+    std::queue<std::function<void()>> file_jobs;
+    std::condition_variable file_condition;
+    bool stopping = false;
+    std::thread thread;
+    std::vector<std::thread> file_threads;
+};
+
+EventLoop event_loop;
+
+// Fire-and-forget coroutine that owns a spawned task until it completes
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() {}
+    };
+};
+
+DetachedTask run_detached(EventLoop& loop, task<> work, std::atomic<size_t> *running) {
+    co_await loop.schedule();
+    try {
+        co_await work;
+    } catch (const std::exception& e) {
+        log(std::string("Coroutine failed: ") + e.what());
+    }
+    if (running)
+        (*running)--;
+}
+
+void EventLoop::start(ThreadPool *pool) {
+    thread_pool = pool;
+    stopping = false;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+    thread = std::thread([this] { run(); });
+    for (int i = 0; i < FILE_THREADS; i++)
+        file_threads.emplace_back([this] { run_files(); });
+}
+
+void EventLoop::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {}
+    file_condition.notify_all();
+    if (thread.joinable())
+        thread.join();
+    for (std::thread& file_thread : file_threads)
+        file_thread.join();
+    file_threads.clear();
+    // Coroutines still suspended here are abandoned; the process is about to exit
+    close(epoll_fd);
+    close(wake_fd);
+}
+
+void EventLoop::spawn(task<> work, bool background) {
+    if (!background)
+        running++;
+    run_detached(*this, std::move(work), background ? nullptr : &running);
+}
+
+bool EventLoop::add(Wait *wait) {
+    if (wait->fd >= 0) {
+        epoll_event event{};
+        event.events = wait->events | EPOLLONESHOT;
+        event.data.ptr = wait;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wait->fd, &event) < 0)
+            return false;   // resume right away, not ready
+    }
+    if (wait->timeout != NO_TIMEOUT) {
+        wait->timer = timers.emplace(std::chrono::steady_clock::now() + wait->timeout, wait);
+        wait->has_timer = true;
+    }
+    return true;
+}
+
+void EventLoop::rearm(Wait *wait, uint32_t events) {
+    wait->events = events;
+    epoll_event event{};
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = wait;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, wait->fd, &event);
+}
+
+void EventLoop::post(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        posted.push_back(handle);
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {}
+}
+
+void EventLoop::submit(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        file_jobs.push(std::move(job));
+    }
+    file_condition.notify_one();
+}
+
+void EventLoop::run() {
+    std::vector<std::coroutine_handle<>> ready;
+    epoll_event events[64];
+    while (true) {
+        int timeout = -1;
+        if (!timers.empty()) {
+            auto until = timers.begin()->first - std::chrono::steady_clock::now();
+            timeout = std::max<long long>(0, std::chrono::ceil<std::chrono::milliseconds>(until).count());
+        }
+        int n = epoll_wait(epoll_fd, events, std::size(events), timeout);
+
+        // Collect everything that became runnable before resuming any of it
+        for (int i = 0; i < n; i++) {
+            auto *wait = static_cast<Wait*>(events[i].data.ptr);
+            if (!wait) {
+                uint64_t count;
+                if (read(wake_fd, &count, sizeof(count)) < 0) {}
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping)
+                    return;
+                ready.insert(ready.end(), posted.begin(), posted.end());
+                posted.clear();
+                continue;
+            }
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, wait->fd, nullptr);
+            if (wait->has_timer)
+                timers.erase(wait->timer);
+            wait->ready = true;
+            ready.push_back(wait->handle);
+        }
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.begin()->first <= now) {
+            Wait *wait = timers.begin()->second;
+            timers.erase(timers.begin());
+            if (wait->fd >= 0)
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, wait->fd, nullptr);
+            ready.push_back(wait->handle);
+        }
+
+        for (std::coroutine_handle<> handle : ready)
+            handle.resume();
+        ready.clear();
+    }
+}
+
+void EventLoop::run_files() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            file_condition.wait(lock, [this] { return stopping || !file_jobs.empty(); });
+            if (stopping)
+                return;
+            job = std::move(file_jobs.front());
+            file_jobs.pop();
+        }
+        job();
+    }
+}
+
+// Response Cache: complete responses of handler and proxied routes, kept as long as their
+// Cache-Control allows (s-maxage, else max-age; never no-store, no-cache or private responses,
+// nor ones that set cookies). A response with Vary is stored once per value of the request
+// headers it names. The store is split into SHARDS shards, each an LRU list bounded by its
+// share of the byte budget, and a new entry may only displace entries that a TinyLFU sketch of
+// recent requests says are wanted less often than it. Concurrent misses on one key are
+// coalesced: the first request goes to the handler and the others wait for its response.
+class ResponseCache {
+public:
+    static const size_t SHARDS = 16;
+
+    struct Entry {
+        std::string key;
+        std::string primary;
+        std::string head;   // status line and headers, each line ending in "\r\n"
+        std::string body;
+        std::chrono::steady_clock::time_point stored;
+        std::chrono::steady_clock::time_point expires;
+        size_t size() const { return key.size() + head.size() + body.size(); }
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+    using HeaderLookup = std::function<std::string_view(std::string_view)>;
+
+    // A miss being filled; requests for the same key wait for it
+    struct Flight {
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool done = false;
+        std::vector<std::coroutine_handle<>> waiters;
+    };
+
+    // Outcome of a lookup: a hit, a miss this request has to fill (leader), a miss another
+    // request is filling (flight only), or nothing when the request bypasses the cache. A
+    // leader ticket dropped without fill() still releases the requests waiting on it.
+    class Ticket {
+    public:
+        Ticket() = default;
+        Ticket(Ticket&& other) noexcept { *this = std::move(other); }
+        Ticket& operator=(Ticket&& other) noexcept;
+        ~Ticket();
+        bool waiting() const { return flight && !leader; }
+
+        EntryPtr hit;
+        std::shared_ptr<Flight> flight;
+        bool leader = false;
+        std::string primary;
+        std::string key;
+        ResponseCache *cache = nullptr;
+    };
+
+    // Awaitable that resumes a coroutine once a flight is over
+    struct FlightWait {
+        std::shared_ptr<Flight> flight;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> caller);
+        void await_resume() const noexcept {}
+    };
+
+    void configure(size_t capacity, size_t max_entry_size);
+    Ticket lookup(std::string_view primary, const HeaderLookup& header);
+    EntryPtr find(std::string_view primary, const HeaderLookup& header);
+    // Offers the leader's response for storing and releases the requests waiting for it
+    void fill(Ticket& ticket, std::string_view response, const HeaderLookup& header);
+    // Blocks a worker until the flight of a waiting ticket is over (at most `timeout`), then
+    // looks again
+    EntryPtr wait(Ticket& ticket, const HeaderLookup& header, std::chrono::milliseconds timeout);
+    FlightWait wait_async(Ticket& ticket) { return {ticket.flight}; }
+    static std::string render(const Entry& entry, bool close);
+    size_t max_entry() const { return max_entry_size; }
+    size_t bytes() const { return used; }
+
+private:
+    struct VaryInfo {
+        std::vector<std::string> names;
+        size_t entries = 0;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::list<EntryPtr> lru;
+        std::unordered_map<std::string, std::list<EntryPtr>::iterator, StringHash, std::equal_to<>> index;
+        std::unordered_map<std::string, VaryInfo, StringHash, std::equal_to<>> vary;
+        std::unordered_map<std::string, std::shared_ptr<Flight>, StringHash, std::equal_to<>> flights;
+        // TinyLFU: count-min sketch, SKETCH_ROWS rows of `width` saturating 4-bit counters,
+        // halved every 10 * width additions so old popularity fades
+        std::vector<uint8_t> sketch;
+        size_t width = 0;
+        size_t additions = 0;
+        size_t budget = 0;
+        size_t used = 0;
+    };
+    static const size_t SKETCH_ROWS = 4;
+    Shard& shard_for(std::string_view primary) { return shards[std::hash<std::string_view>{}(primary) % SHARDS]; }
+    static std::string key_locked(Shard& shard, std::string_view primary, const HeaderLookup& header);
+    static size_t sketch_slot(const Shard& shard, std::string_view key, size_t row);
+    static void record_locked(Shard& shard, std::string_view key);
+    static unsigned frequency_locked(const Shard& shard, std::string_view key);
+    EntryPtr find_locked(Shard& shard, const std::string& key);
+    void erase_locked(Shard& shard, std::list<EntryPtr>::iterator it);
+    void finish(Ticket& ticket);
+    std::array<Shard, SHARDS> shards;
+    std::atomic<size_t> max_entry_size{0};
+    std::atomic<size_t> used{0};
+};
+
+ResponseCache response_cache;
+
+ResponseCache::Ticket& ResponseCache::Ticket::operator=(Ticket&& other) noexcept {
+    if (this != &other) {
+        if (leader)
+            cache->finish(*this);
+        hit = std::move(other.hit);
+        flight = std::move(other.flight);
+        leader = std::exchange(other.leader, false);
+        primary = std::move(other.primary);
+        key = std::move(other.key);
+        cache = other.cache;
+    }
+    return *this;
+}
+
+ResponseCache::Ticket::~Ticket() {
+    if (leader)
+        cache->finish(*this);
+}
+
+bool ResponseCache::FlightWait::await_suspend(std::coroutine_handle<> caller) {
+    std::lock_guard<std::mutex> lock(flight->mutex);
+    if (flight->done)
+        return false;
+    flight->waiters.push_back(caller);
+    return true;
+}
+
+void ResponseCache::configure(size_t capacity, size_t max_entry) {
+    max_entry_size = max_entry;
+    for (Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.budget = capacity / SHARDS;
+        // About one counter per kilobyte of budget
+        size_t width = 64;
+        while (width < shard.budget / 1024)
+            width *= 2;
+        if (width != shard.width) {
+            shard.width = width;
+            shard.sketch.assign(SKETCH_ROWS * width, 0);
+            shard.additions = 0;
+        }
+        while (shard.used > shard.budget && !shard.lru.empty())
+            erase_locked(shard, std::prev(shard.lru.end()));
+    }
+}
+
+std::string ResponseCache::key_locked(Shard& shard, std::string_view primary, const HeaderLookup& header) {
+    std::string key(primary);
+    if (auto vary = shard.vary.find(primary); vary != shard.vary.end()) {
+        for (const std::string& name : vary->second.names) {
+            key += '\n';
+            key += header(name);
+        }
+    }
+    return key;
+}
+
+size_t ResponseCache::sketch_slot(const Shard& shard, std::string_view key, size_t row) {
+    uint64_t x = std::hash<std::string_view>{}(key) + (row + 1) * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return row * shard.width + ((x ^ (x >> 31)) & (shard.width - 1));
+}
+
+void ResponseCache::record_locked(Shard& shard, std::string_view key) {
+    for (size_t row = 0; row < SKETCH_ROWS; row++) {
+        uint8_t& counter = shard.sketch[sketch_slot(shard, key, row)];
+        if (counter < 15)
+            counter++;
+    }
+    if (++shard.additions >= 10 * shard.width) {
+        for (uint8_t& counter : shard.sketch)
+            counter /= 2;
+        shard.additions /= 2;
+    }
+}
+
+unsigned ResponseCache::frequency_locked(const Shard& shard, std::string_view key) {
+    unsigned frequency = 15;
+    for (size_t row = 0; row < SKETCH_ROWS; row++)
+        frequency = std::min<unsigned>(frequency, shard.sketch[sketch_slot(shard, key, row)]);
+    return frequency;
+}
+
+ResponseCache::EntryPtr ResponseCache::find_locked(Shard& shard, const std::string& key) {
+    auto it = shard.index.find(key);
+    if (it == shard.index.end())
+        return nullptr;
+    if ((*it->second)->expires <= std::chrono::steady_clock::now()) {
+        erase_locked(shard, it->second);
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return *it->second;
+}
+
+void ResponseCache::erase_locked(Shard& shard, std::list<EntryPtr>::iterator it) {
+    const Entry& entry = **it;
+    shard.used -= entry.size();
+    used -= entry.size();
+    if (auto vary = shard.vary.find(entry.primary); vary != shard.vary.end() && --vary->second.entries == 0)
+        shard.vary.erase(vary);
+    shard.index.erase(entry.key);
+    shard.lru.erase(it);
+}
+
+ResponseCache::Ticket ResponseCache::lookup(std::string_view primary, const HeaderLookup& header) {
+    Ticket ticket;
+    Shard& shard = shard_for(primary);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.budget == 0)
+        return ticket;
+    ticket.cache = this;
+    ticket.primary = primary;
+    ticket.key = key_locked(shard, primary, header);
+    record_locked(shard, ticket.key);
+    if ((ticket.hit = find_locked(shard, ticket.key))) {
+        metrics.response_cache_hits++;
+        return ticket;
+    }
+    auto [flight, created] = shard.flights.try_emplace(ticket.key);
+    if (created) {
+        flight->second = std::make_shared<Flight>();
+        ticket.leader = true;
+        metrics.response_cache_misses++;
+    } else {
+        metrics.response_cache_coalesced++;
+    }
+    ticket.flight = flight->second;
+    return ticket;
+}
+
+ResponseCache::EntryPtr ResponseCache::find(std::string_view primary, const HeaderLookup& header) {
+    Shard& shard = shard_for(primary);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return find_locked(shard, key_locked(shard, primary, header));
+}
+
+ResponseCache::EntryPtr ResponseCache::wait(Ticket& ticket, const HeaderLookup& header,
+                                            std::chrono::milliseconds timeout) {
+    {
+        std::unique_lock<std::mutex> lock(ticket.flight->mutex);
+        ticket.flight->condition.wait_for(lock, timeout, [&] { return ticket.flight->done; });
+    }
+    return find(ticket.primary, header);
+}
+
+void ResponseCache::finish(Ticket& ticket) {
+    ticket.leader = false;
+    {
+        Shard& shard = shard_for(ticket.primary);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (auto flight = shard.flights.find(ticket.key); flight != shard.flights.end() && flight->second == ticket.flight)
+            shard.flights.erase(flight);
+    }
+    std::vector<std::coroutine_handle<>> waiters;
+    {
+        std::lock_guard<std::mutex> lock(ticket.flight->mutex);
+        ticket.flight->done = true;
+        waiters.swap(ticket.flight->waiters);
+    }
+    ticket.flight->condition.notify_all();
+    for (std::coroutine_handle<> waiter : waiters)
+        event_loop.post(waiter);
+}
+
+void ResponseCache::fill(Ticket& ticket, std::string_view response, const HeaderLookup& header) {
+    if (!ticket.leader)
+        return;
+    size_t header_end = response.find("\r\n\r\n");
+    if (header_end == std::string_view::npos || response.size() > max_entry_size || response.size() < 12) {
+        finish(ticket);
+        return;
+    }
+    std::string_view head = response.substr(0, header_end + 2);
+    std::string_view body = response.substr(header_end + 4);
+
+    // Only explicitly fresh, shareable responses with a known length are stored
+    int status = 0;
+    std::from_chars(response.data() + 9, response.data() + 12, status);
+    static const int storable_statuses[] = {200, 203, 204, 300, 301, 404, 405, 410, 414, 501};
+    long long ttl = -1, shared_ttl = -1;
+    bool storable = std::find(std::begin(storable_statuses), std::end(storable_statuses), status) !=
+                    std::end(storable_statuses);
+    for_each_token(find_raw_header(head, "Cache-Control"), [&](std::string_view directive) {
+        if (iequals(directive, "no-store") || iequals(directive, "no-cache") || iequals(directive, "private"))
+            storable = false;
+        size_t equals = directive.find('=');
+        std::string_view name = trim(directive.substr(0, equals));
+        if (equals != std::string_view::npos) {
+            std::string_view value = trim(directive.substr(equals + 1));
+            long long seconds = -1;
+            std::from_chars(value.data(), value.data() + value.size(), seconds);
+            if (iequals(name, "s-maxage"))
+                shared_ttl = seconds;
+            else if (iequals(name, "max-age"))
+                ttl = seconds;
+        }
+        return storable;
+    });
+    if (shared_ttl >= 0)
+        ttl = shared_ttl;
+    std::string_view content_length = find_raw_header(head, "Content-Length");
+    size_t length = 0;
+    std::from_chars(content_length.data(), content_length.data() + content_length.size(), length);
+    std::vector<std::string> vary;
+    for_each_token(find_raw_header(head, "Vary"), [&](std::string_view name) {
+        vary.emplace_back(name);
+        return true;
+    });
+    if (!storable || ttl <= 0 || content_length.empty() || length != body.size() ||
+        !find_raw_header(head, "Set-Cookie").empty() ||
+        std::find(vary.begin(), vary.end(), "*") != vary.end()) {
+        finish(ticket);
+        return;
+    }
+
+    // Keep the end-to-end headers only; Connection and Age are added per response
+    auto entry = std::make_shared<Entry>();
+    entry->primary = ticket.primary;
+    for (size_t line = 0; line < head.size();) {
+        size_t line_end = head.find("\r\n", line) + 2;
+        std::string_view text = head.substr(line, line_end - line);
+        line = line_end;
+        size_t colon = text.find(':');
+        std::string_view name = colon == std::string_view::npos ? std::string_view() : text.substr(0, colon);
+        if (!iequals(name, "Connection") && !iequals(name, "Keep-Alive") && !iequals(name, "Age"))
+            entry->head += text;
+    }
+    entry->body = body;
+    entry->stored = std::chrono::steady_clock::now();
+    entry->expires = entry->stored + std::chrono::seconds(ttl);
+
+    {
+        Shard& shard = shard_for(ticket.primary);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        // The key includes the values of the headers this response varies on
+        entry->key = ticket.primary;
+        for (const std::string& name : vary) {
+            entry->key += '\n';
+            entry->key += header(name);
+        }
+        size_t size = entry->size();
+        if (auto old = shard.index.find(entry->key); old != shard.index.end())
+            erase_locked(shard, old->second);
+
+        // TinyLFU admission: the victims at the LRU tail must all be less popular than the newcomer
+        // Entries of one path must all vary on the same headers
+        auto known = shard.vary.find(ticket.primary);
+        unsigned frequency = frequency_locked(shard, ticket.key);
+        size_t freed = 0;
+        auto victim = shard.lru.end();
+        bool admit = size <= shard.budget && (known == shard.vary.end() || known->second.names == vary);
+        while (admit && shard.used - freed + size > shard.budget && victim != shard.lru.begin()) {
+            --victim;
+            if (frequency_locked(shard, (*victim)->key) >= frequency)
+                admit = false;
+            freed += (*victim)->size();
+        }
+        if (!admit) {
+            metrics.response_cache_rejected++;
+        } else {
+            while (shard.used + size > shard.budget) {
+                erase_locked(shard, std::prev(shard.lru.end()));
+                metrics.response_cache_evictions++;
+            }
+            VaryInfo& info = shard.vary[ticket.primary];
+            info.names = vary;
+            info.entries++;
+            shard.lru.push_front(entry);
+            shard.index[entry->key] = shard.lru.begin();
+            shard.used += size;
+            used += size;
+            metrics.response_cache_stores++;
+        }
+    }
+    finish(ticket);
+}
+
+std::string ResponseCache::render(const Entry& entry, bool close) {
+    auto age = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - entry.stored);
+    std::string response;
+    response.reserve(entry.head.size() + entry.body.size() + 48);
+    response += entry.head;
+    response += "Age: " + std::to_string(age.count()) + "\r\n";
+    if (close)
+        response += "Connection: close\r\n";
+    response += "\r\n";
+    response += entry.body;
+    return response;
+}
+
+// Function to check whether a request may be answered from the response cache: plain GETs
+// without credentials whose client did not ask to bypass caches
+bool cacheable_request(std::string_view method, const ResponseCache::HeaderLookup& header) {
+    if (method != "GET" || !header("Authorization").empty() || iequals(header("Pragma"), "no-cache"))
+        return false;
+    bool bypass = false;
+    for_each_token(header("Cache-Control"), [&](std::string_view directive) {
+        bypass = iequals(directive, "no-cache") || iequals(directive, "no-store");
+        return !bypass;
+    });
+    return !bypass;
+}
+
+// Function to look a parsed request up in the response cache; an empty ticket if it bypasses it
+ResponseCache::Ticket lookup_response(const RequestInfo& request_info) {
+    auto header = [&request_info](std::string_view name) { return get_header(request_info, name); };
+    if (!cacheable_request(request_info.at("method"), header))
+        return {};
+    return response_cache.lookup(request_info.at("path"), header);
+}
+
+// Function to read a whole file without blocking the event loop; empty if it cannot be read
+task<std::optional<std::string>> read_file_async(std::string path) {
+    co_return co_await event_loop.offload([path = std::move(path)]() -> std::optional<std::string> {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return std::nullopt;
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    });
+}
+
+// Function to write all of `data` over a non-blocking connection, waiting for the socket as the
+// transport needs; false on error or when a wait exceeds the write timeout
+task<bool> transport_write_async(SSL *ssl, int fd, std::string_view data) {
+    while (!data.empty()) {
+        if (abort_connections)
+            co_return false;
+        // The loop thread serves many connections; an error left queued by one of them must not
+        // turn another one's WANT_READ/WANT_WRITE into a failure
+        ERR_clear_error();
+        int n = transport_write(ssl, fd, data.data(), data.size());
+        if (n > 0) {
+            data.remove_prefix(n);
+            continue;
+        }
+        int error = transport_error(ssl, n, true);
+        uint32_t events = 0;
+        if (error == SSL_ERROR_WANT_READ)
+            events = EPOLLIN;
+        else if (error == SSL_ERROR_WANT_WRITE)
+            events = EPOLLOUT;
+        if (!events)
+            co_return false;
+        if (!co_await event_loop.wait_io(fd, events, std::chrono::milliseconds(WRITE_TIMEOUT_MS))) {
+            metrics.connection_timeouts[Connection::WRITE]++;
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+// Coroutine Handler Function Type
+using AsyncHandlerFunc = task<Response>(*)(AsyncRequest);
+
+// Function to move a connection to the event loop. The worker that read the request is free
+// again as soon as it returns; the coroutine serving the request ends with finish_parked().
+ParkedConnection* park_connection(Connection& conn, bool keep_alive, int served) {
+    auto *parked = new ParkedConnection{conn.fd, conn.ssl, conn.peer, conn.listener, std::move(conn.buffer), conn.buffered,
+                                        served, keep_alive};
+    set_nonblocking(conn.fd, true);
+    event_loop.pool().park();
+    metrics.async_handlers++;
+    return parked;
+}
+
+// Function to give a parked connection back to the thread pool for its next request, or to
+// close it
+void finish_parked(ParkedConnection *conn, bool reusable, bool close_notify) {
+    ThreadPool& pool = event_loop.pool();
+    if (reusable) {
+        set_nonblocking(conn->fd, false);
+        pool.resume(conn->fd, conn->peer, conn->listener, conn);
+        return;
+    }
+    if (close_notify && conn->ssl)
+        SSL_shutdown(conn->ssl);
+    discard_parked(conn);
+    pool.unpark();
+}
+
+// Function to copy a parsed request out of the request arena
+AsyncRequest copy_request(const RequestInfo& request_info) {
+    AsyncRequest request;
+    for (const auto& [key, value] : request_info)
+        request.emplace(std::string(key), std::string(value));
+    return request;
+}
+
+// Function to look up a header of a copied request by name (case-insensitive); empty if absent
+std::string_view get_header(const AsyncRequest& request, std::string_view name) {
+    for (const auto& [key, value] : request) {
+        if (iequals(key, name))
+            return value;
+    }
+    return {};
+}
+
+// Function to wait for the request a cache ticket is coalesced with; true if it left a
+// response in the cache for this one
+task<bool> await_cached(ResponseCache::Ticket& ticket, const AsyncRequest& request) {
+    if (!ticket.waiting())
+        co_return false;
+    co_await response_cache.wait_async(ticket);
+    ticket.hit = response_cache.find(ticket.primary, [&request](std::string_view name) { return get_header(request, name); });
+    co_return ticket.hit != nullptr;
+}
+
+// Function to run a coroutine handler for a parked connection and write its response
+task<> serve_async(ParkedConnection *conn, AsyncHandlerFunc handler, AsyncRequest request,
+                   ResponseCache::Ticket ticket) {
+    std::string bytes;
+    if (co_await await_cached(ticket, request)) {
+        bytes = ResponseCache::render(*ticket.hit, false);
+    } else {
+        Response response;
+        try {
+            response = co_await handler(request);
+        } catch (const std::exception& e) {
+            log(std::string("Handler failed: ") + e.what());
+            response = {"500 Internal Server Error", "text/plain", "", "Internal Server Error"};
+        }
+        bytes = "HTTP/1.1 " + response.status + "\r\n";
+        bytes += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+        bytes += "Content-Type: " + response.content_type + "\r\n";
+        bytes += response.headers;
+        bytes += "\r\n";
+        bytes += response.body;
+        response_cache.fill(ticket, bytes, [&request](std::string_view name) { return get_header(request, name); });
+    }
+
+    bool keep_alive = conn->keep_alive && !draining;
+    if (!keep_alive)
+        bytes.insert(bytes.find("\r\n\r\n") + 2, "Connection: close\r\n");
+    bool sent = co_await transport_write_async(conn->ssl, conn->fd, bytes);
+    if (!sent)
+        log("Failed to send response to client.");
+    finish_parked(conn, sent && keep_alive, sent);
+}
+
+// Function to read whatever a non-blocking socket has, waiting up to `timeout` for data;
+// returns 0 at end of stream and -1 on error, with errno ETIMEDOUT if the wait ran out
+task<ssize_t> read_async(int fd, char *buffer, size_t size, std::chrono::milliseconds timeout) {
+    while (true) {
+        ssize_t n = read(fd, buffer, size);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            co_return n;
+        if (!co_await event_loop.wait_io(fd, EPOLLIN, timeout)) {
+            errno = ETIMEDOUT;
+            co_return -1;
+        }
+    }
+}
+
+// Function to write all of `data` to a non-blocking socket; false on error or timeout
+task<bool> write_async(int fd, std::string_view data, std::chrono::milliseconds timeout) {
+    while (!data.empty()) {
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            data.remove_prefix(n);
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!co_await event_loop.wait_io(fd, EPOLLOUT, timeout))
+                co_return false;
+        } else {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+// Finds where a chunked body ends while its bytes stream past unchanged, so a relayed chunked
+// response can be delimited without decoding it
+struct ChunkScanner {
+    enum State { SIZE, EXTENSION, SIZE_LF, DATA, DATA_CR, DATA_LF, TRAILER, TRAILER_LINE, FINAL_LF, DONE };
+    State state = SIZE;
+    uint64_t remaining = 0;
+    bool error = false;
+
+    // Returns how many bytes of `data` belong to the body; fewer than all only once it is done
+    size_t feed(std::string_view data);
+    bool done() const { return state == DONE; }
+};
+
+size_t ChunkScanner::feed(std::string_view data) {
+    size_t i = 0;
+    auto end_size_line = [this] { state = remaining ? DATA : TRAILER; };
+    while (i < data.size() && state != DONE && !error) {
+        char c = data[i];
+        switch (state) {
+        case SIZE:
+            if (std::isxdigit(static_cast<unsigned char>(c))) {
+                if (remaining >> 60)
+                    error = true;
+                remaining = remaining * 16 + (std::isdigit(static_cast<unsigned char>(c)) ? c - '0' : (c | 0x20) - 'a' + 10);
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                state = EXTENSION;
+            } else if (c == '\r') {
+                state = SIZE_LF;
+            } else if (c == '\n') {
+                end_size_line();
+            } else {
+                error = true;
+            }
+            break;
+        case EXTENSION:
+            if (c == '\r')
+                state = SIZE_LF;
+            else if (c == '\n')
+                end_size_line();
+            break;
+        case SIZE_LF:
+            if (c == '\n')
+                end_size_line();
+            else
+                error = true;
+            break;
+        case DATA: {
+            size_t take = std::min<uint64_t>(remaining, data.size() - i);
+            remaining -= take;
+            i += take;
+            if (remaining == 0)
+                state = DATA_CR;
+            continue;
+        }
+        case DATA_CR:
+            if (c == '\r')
+                state = DATA_LF;
+            else if (c == '\n')
+                state = SIZE;
+            else
+                error = true;
+            break;
+        case DATA_LF:
+            if (c == '\n')
+                state = SIZE;
+            else
+                error = true;
+            break;
+        case TRAILER:
+            if (c == '\r')
+                state = FINAL_LF;
+            else if (c == '\n')
+                state = DONE;
+            else
+                state = TRAILER_LINE;
+            break;
+        case TRAILER_LINE:
+            if (c == '\n')
+                state = TRAILER;
+            break;
+        case FINAL_LF:
+            if (c == '\n')
+                state = DONE;
+            else
+                error = true;
+            break;
+        case DONE:
+            break;
+        }
+        i++;
+    }
+    return i;
+}
+
+// Upstream pool as configured under "upstreams" in config.json
+struct UpstreamConfig {
+    std::vector<std::string> servers;   // "host:port"
+    std::string health_check_path;      // empty: health checks only test that a connect succeeds
+    int max_idle_connections = 32;      // kept-alive connections per server
+
+    bool operator==(const UpstreamConfig&) const = default;
+};
+
+// Upstream Pool: the backends behind a proxied route. Each request goes to the healthy backend
+// with the fewest requests outstanding, over a kept-alive connection when one is idle. Idle
+// connections and health checks live on the event loop thread; the counters read by /metrics
+// are atomic.
+class Upstream {
+public:
+    struct Backend {
+        std::string address;
+        sockaddr_storage addr{};
+        socklen_t addr_len = 0;
+        std::vector<int> idle;
+        std::atomic<int> outstanding{0};
+        std::atomic<bool> healthy{true};
+    };
+
+    Upstream(std::string name, const UpstreamConfig& config);
+    Backend& pick();
+    // Returns an idle connection that still looks usable, or -1
+    int take_idle(Backend& backend);
+    void release(Backend& backend, int fd, bool reusable);
+    void set_health(Backend& backend, bool healthy);
+    task<> check_health();
+
+    std::string name;
+    std::string health_check_path;
+    size_t max_idle;
+    std::deque<Backend> backends;
+
+private:
+    size_t next = 0;
+};
+
+Upstream::Upstream(std::string name, const UpstreamConfig& config)
+    : name(std::move(name)), health_check_path(config.health_check_path), max_idle(config.max_idle_connections) {
+    for (const std::string& server : config.servers) {
+        Backend& backend = backends.emplace_back();
+        backend.address = server;
+        size_t colon = server.rfind(':');
+        std::string host = server.substr(0, colon);
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+            host = host.substr(1, host.size() - 2);
+        addrinfo hints{};
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        if (getaddrinfo(host.c_str(), server.c_str() + colon + 1, &hints, &result) == 0 && result) {
+            std::memcpy(&backend.addr, result->ai_addr, result->ai_addrlen);
+            backend.addr_len = result->ai_addrlen;
+            freeaddrinfo(result);
+        } else {
+            log("Cannot resolve upstream server " + server);
+            backend.healthy = false;
+        }
+    }
+}
+
+Upstream::Backend& Upstream::pick() {
+    // Least outstanding requests; ties go round robin. With no healthy backend left, all are
+    // tried rather than failing every request outright.
+    bool any_healthy = std::any_of(backends.begin(), backends.end(), [](const Backend& b) { return b.healthy.load(); });
+    Backend *best = nullptr;
+    for (size_t i = 0; i < backends.size(); i++) {
+        Backend& backend = backends[(next + i) % backends.size()];
+        if (any_healthy && !backend.healthy)
+            continue;
+        if (!best || backend.outstanding < best->outstanding)
+            best = &backend;
+    }
+    next++;
+    return *best;
+}
+
+int Upstream::take_idle(Backend& backend) {
+    while (!backend.idle.empty()) {
+        int fd = backend.idle.back();
+        backend.idle.pop_back();
+        // An idle connection with something to read has been closed (or broken) by the backend
+        pollfd pfd{fd, POLLIN, 0};
+        if (poll(&pfd, 1, 0) == 0)
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+void Upstream::release(Backend& backend, int fd, bool reusable) {
+    if (reusable && backend.idle.size() < max_idle)
+        backend.idle.push_back(fd);
+    else
+        close(fd);
+}
+
+void Upstream::set_health(Backend& backend, bool healthy) {
+    if (backend.healthy.exchange(healthy) != healthy)
+        log("Upstream " + name + " server " + backend.address + " is " + (healthy ? "up" : "down"));
+}
+
+// Function to open a non-blocking connection to an upstream server; -1 on failure or timeout
+task<int> connect_upstream(const Upstream::Backend& backend) {
+    if (backend.addr_len == 0)
+        co_return -1;
+    int fd = socket(backend.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        co_return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&backend.addr), backend.addr_len) < 0) {
+        int error = errno;
+        socklen_t length = sizeof(error);
+        if (error != EINPROGRESS ||
+            !co_await event_loop.wait_io(fd, EPOLLOUT, std::chrono::milliseconds(PROXY_CONNECT_TIMEOUT_MS)) ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            close(fd);
+            co_return -1;
+        }
+    }
+    metrics.upstream_connections_opened++;
+    co_return fd;
+}
+
+// Health checks: every health_check_interval_ms each server is connected to and, with a
+// health_check_path, asked for it; a 2xx or 3xx answer marks it up. Requests that cannot reach
+// a server mark it down in between.
+task<> Upstream::check_health() {
+    while (true) {
+        for (Backend& backend : backends) {
+            bool healthy = false;
+            int fd = co_await connect_upstream(backend);
+            if (fd >= 0 && health_check_path.empty()) {
+                healthy = true;
+            } else if (fd >= 0) {
+                std::string probe = "GET " + health_check_path + " HTTP/1.1\r\nHost: " + backend.address +
+                                    "\r\nConnection: close\r\n\r\n";
+                auto timeout = std::chrono::milliseconds(PROXY_CONNECT_TIMEOUT_MS);
+                char status[32] = {};
+                if (co_await write_async(fd, probe, timeout) &&
+                    co_await read_async(fd, status, sizeof(status) - 1, timeout) > 12) {
+                    healthy = std::strncmp(status, "HTTP/1.", 7) == 0 && (status[9] == '2' || status[9] == '3');
+                }
+            }
+            if (fd >= 0)
+                close(fd);
+            set_health(backend, healthy);
+        }
+        co_await event_loop.sleep_for(std::chrono::milliseconds(HEALTH_CHECK_INTERVAL_MS));
+    }
+}
+
+// Upstream pools by name, and proxied path prefixes (longest first). Built once at startup.
+std::map<std::string, std::unique_ptr<Upstream>> upstreams;
+std::vector<std::pair<std::string, Upstream*>> proxy_routes;
+
+// Function to find the upstream pool a request path is forwarded to, if any
+Upstream* find_proxy_route(std::string_view path) {
+    for (const auto& [prefix, upstream] : proxy_routes) {
+        if (path.starts_with(prefix))
+            return upstream;
+    }
+    return nullptr;
+}
+
+// Function to build the request sent upstream: the client's request line and headers minus
+// hop-by-hop ones, with forwarding headers added and the body (already de-chunked) framed by
+// Content-Length. HTTP/1.0 clients are forwarded as HTTP/1.0 so the response can reach them
+// unchanged.
+std::string build_upstream_request(const AsyncRequest& request, const PeerAddress& peer, bool tls) {
+    static const char *hop_by_hop[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+                                       "Transfer-Encoding", "Upgrade", "Content-Length", "Expect"};
+    static const char *fields[] = {"method", "path", "version", "body"};
+    const std::string& body = request.at("body");
+    std::string upstream_request = request.at("method") + " " + request.at("path") + " " +
+                                   (request.at("version") == "HTTP/1.0" ? "HTTP/1.0" : "HTTP/1.1") + "\r\n";
+    char client[INET6_ADDRSTRLEN];
+    std::string forwarded_for(client, peer.format(client, sizeof(client)));
+    for (const auto& [name, value] : request) {
+        auto is = [&name](const char *other) { return iequals(name, other); };
+        if (std::any_of(std::begin(fields), std::end(fields), [&name](const char *field) { return name == field; }) ||
+            std::any_of(std::begin(hop_by_hop), std::end(hop_by_hop), is))
+            continue;
+        if (is("X-Forwarded-For")) {
+            forwarded_for = value + ", " + forwarded_for;
+            continue;
+        }
+        upstream_request += name + ": " + value + "\r\n";
+    }
+    upstream_request += "X-Forwarded-For: " + forwarded_for + "\r\n";
+    upstream_request += tls ? "X-Forwarded-Proto: https\r\n" : "X-Forwarded-Proto: http\r\n";
+    if (!body.empty() || request.at("method") == "POST" || request.at("method") == "PUT")
+        upstream_request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    upstream_request += "\r\n";
+    upstream_request += body;
+    return upstream_request;
+}
+
+// Function to forward a parked connection's request to an upstream pool and stream the response
+// back as it arrives. A kept-alive upstream connection that turns out to be closed is retried
+// once on a fresh one; a backend that cannot be reached answers 502, one that is too slow 504.
+task<> serve_proxy(ParkedConnection *conn, Upstream *upstream, AsyncRequest request,
+                   ResponseCache::Ticket ticket) {
+    bool keep_alive = conn->keep_alive && !draining;
+    if (co_await await_cached(ticket, request)) {
+        bool sent = co_await transport_write_async(conn->ssl, conn->fd, ResponseCache::render(*ticket.hit, !keep_alive));
+        finish_parked(conn, sent && keep_alive, sent);
+        co_return;
+    }
+    metrics.proxy_requests++;
+    auto read_timeout = std::chrono::milliseconds(PROXY_READ_TIMEOUT_MS);
+    std::string upstream_request = build_upstream_request(request, conn->peer, conn->ssl != nullptr);
+    Upstream::Backend& backend = upstream->pick();
+    backend.outstanding++;
+
+    BufferPool::Lease slab = buffer_pool.acquire();
+    std::string received;
+    size_t header_end = std::string::npos;
+    int fd = -1;
+    bool timed_out = false;
+    for (int attempt = 0; attempt < 2 && header_end == std::string::npos; attempt++) {
+        fd = upstream->take_idle(backend);
+        bool reused = fd >= 0;
+        if (reused) {
+            metrics.upstream_connections_reused++;
+        } else if ((fd = co_await connect_upstream(backend)) < 0) {
+            upstream->set_health(backend, false);
+            break;
+        }
+        received.clear();
+        bool written = co_await write_async(fd, upstream_request, read_timeout);
+        while (written && (header_end = received.find("\r\n\r\n")) == std::string::npos &&
+               received.size() <= BufferPool::SLAB_SIZE * 4) {
+            ssize_t n = co_await read_async(fd, slab.data(), BufferPool::SLAB_SIZE, read_timeout);
+            if (n <= 0) {
+                timed_out = n < 0 && errno == ETIMEDOUT;
+                break;
+            }
+            received.append(slab.data(), n);
+        }
+        if (header_end == std::string::npos) {
+            close(fd);
+            fd = -1;
+            // Only a reused connection that closed before answering is worth another try
+            if (!reused || timed_out || !received.empty())
+                break;
+        }
+    }
+
+    if (header_end == std::string::npos) {
+        backend.outstanding--;
+        metrics.proxy_errors++;
+        std::string status = timed_out ? "504 Gateway Timeout" : "502 Bad Gateway";
+        std::string response = "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\n" +
+                               (keep_alive ? "" : "Connection: close\r\n") + "\r\n";
+        bool sent = co_await transport_write_async(conn->ssl, conn->fd, response);
+        finish_parked(conn, sent && keep_alive, sent);
+        co_return;
+    }
+
+    // Status line and headers: drop hop-by-hop headers and note how the body is delimited
+    std::string_view head(received.data(), header_end + 2);
+    size_t status_end = head.find("\r\n");
+    std::string_view status_line = head.substr(0, status_end);
+    bool upstream_http11 = status_line.starts_with("HTTP/1.1");
+    int status = 0;
+    if (status_line.size() >= 12)
+        std::from_chars(status_line.data() + 9, status_line.data() + 12, status);
+    enum { NO_BODY, LENGTH, CHUNKED, UNTIL_CLOSE } framing = UNTIL_CLOSE;
+    uint64_t remaining = 0;
+    bool upstream_close = !upstream_http11;
+    std::string client_head = "HTTP/1.1";
+    client_head += status_line.substr(std::min<size_t>(8, status_line.size()));
+    client_head += "\r\n";
+    for (size_t line = status_end + 2; line < head.size();) {
+        size_t line_end = head.find("\r\n", line);
+        std::string_view header = head.substr(line, line_end - line);
+        line = line_end + 2;
+        size_t colon = header.find(':');
+        std::string_view name = header.substr(0, colon);
+        std::string_view value = colon == std::string_view::npos ? std::string_view() : trim(header.substr(colon + 1));
+        if (iequals(name, "Connection")) {
+            for_each_token(value, [&](std::string_view token) {
+                if (iequals(token, "close"))
+                    upstream_close = true;
+                else if (iequals(token, "keep-alive"))
+                    upstream_close = false;
+                return true;
+            });
+            continue;
+        }
+        if (iequals(name, "Keep-Alive") || iequals(name, "Proxy-Connection"))
+            continue;
+        if (iequals(name, "Transfer-Encoding") && !iequals(value, "identity"))
+            framing = CHUNKED;
+        else if (iequals(name, "Content-Length") && framing != CHUNKED &&
+                 std::from_chars(value.data(), value.data() + value.size(), remaining).ec == std::errc())
+            framing = LENGTH;
+        client_head += header;
+        client_head += "\r\n";
+    }
+    if (request["method"] == "HEAD" || status / 100 == 1 || status == 204 || status == 304)
+        framing = NO_BODY;
+    if (framing == UNTIL_CLOSE)
+        keep_alive = false;
+    // The first request for a cacheable key keeps a copy of a response of known length
+    std::string captured;
+    bool capture = ticket.leader && framing == LENGTH && client_head.size() + remaining < response_cache.max_entry();
+    if (capture)
+        captured = client_head + "\r\n";
+    if (!keep_alive)
+        client_head += "Connection: close\r\n";
+    client_head += "\r\n";
+
+    // Body: relay each piece as soon as it arrives, up to where the framing says it ends
+    ChunkScanner scanner;
+    bool complete = framing == NO_BODY;
+    auto take = [&](std::string_view data) -> std::string_view {
+        if (framing == LENGTH) {
+            data = data.substr(0, std::min<uint64_t>(remaining, data.size()));
+            remaining -= data.size();
+            complete = remaining == 0;
+        } else if (framing == CHUNKED) {
+            data = data.substr(0, scanner.feed(data));
+            complete = scanner.done();
+        }
+        return data;
+    };
+    std::string pending = std::move(client_head);
+    std::string_view leftover = std::string_view(received).substr(header_end + 4);
+    std::string_view piece = complete ? std::string_view() : take(leftover);
+    bool extra = piece.size() < leftover.size();
+    pending += piece;
+    if (capture)
+        captured += piece;
+    bool sent = true;
+    bool upstream_failed = false;
+    while (true) {
+        if (!pending.empty() && !(sent = co_await transport_write_async(conn->ssl, conn->fd, pending)))
+            break;
+        pending.clear();
+        if (complete || scanner.error)
+            break;
+        ssize_t n = co_await read_async(fd, slab.data(), BufferPool::SLAB_SIZE, read_timeout);
+        if (n <= 0) {
+            complete = framing == UNTIL_CLOSE && n == 0;
+            upstream_failed = !complete;
+            break;
+        }
+        std::string_view data(slab.data(), n);
+        piece = take(data);
+        extra = piece.size() < data.size();
+        pending.assign(piece);
+        if (capture)
+            captured += piece;
+    }
+    if (upstream_failed || scanner.error)
+        metrics.proxy_errors++;
+    if (capture && complete)
+        response_cache.fill(ticket, captured, [&request](std::string_view name) { return get_header(request, name); });
+
+    backend.outstanding--;
+    upstream->release(backend, fd, complete && !scanner.error && !extra && !upstream_close && framing != UNTIL_CLOSE);
+    // A response cut short can only be signalled to the client by closing the connection
+    finish_parked(conn, sent && complete && !scanner.error && keep_alive, sent && complete);
+}
+
+// WebSocket Sessions: a connection upgraded with "Upgrade: websocket" stays on the event loop for
+// the rest of its life, so an idle WebSocket costs its TLS state and a small coroutine frame but
+// no worker and no read buffer. Client frames are unmasked in place; permessage-deflate is only
+// negotiated without context takeover, so no zlib state outlives a message. A session that has
+// been quiet for websocket_ping_interval_ms is pinged and closed if the next interval passes
+// without a reply. Each session joins the channel of its route, and a broadcast builds its
+// frames once for all subscribers, which queue the same shared bytes.
+const char WEBSOCKET_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// Messages shorter than this are sent uncompressed even when deflate was negotiated
+const size_t WEBSOCKET_DEFLATE_MIN_SIZE = 64;
+
+enum WebSocketOpcode : uint8_t {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA
+};
+
+// One frame received from a client; the payload points into the receive buffer, already unmasked
+struct WebSocketFrame {
+    bool fin;
+    bool compressed;   // RSV1: the message was sent with permessage-deflate
+    uint8_t opcode;
+    std::string_view payload;
+};
+
+// Function to XOR a payload with its 4-byte masking key: 16 bytes at a time with SSE2, then 8
+// with a 64-bit word, then byte by byte. Every step is a multiple of 4, so the key stays aligned.
+void websocket_unmask(char *data, size_t size, const unsigned char key[4]) {
+    uint32_t key32;
+    std::memcpy(&key32, key, sizeof(key32));
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i mask = _mm_set1_epi32(static_cast<int>(key32));
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_xor_si128(block, mask));
+    }
+#endif
+    uint64_t key64 = (static_cast<uint64_t>(key32) << 32) | key32;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, sizeof(word));
+        word ^= key64;
+        std::memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < size; i++)
+        data[i] ^= key[i % 4];
+}
+
+// Function to parse (and unmask) the frame at the start of `data`. Returns its size, 0 if it is
+// not complete yet, -1 if it breaks the protocol (unmasked, reserved bits set, a fragmented or
+// oversized control frame), or -2 if its payload is over `max_payload`.
+long long parse_websocket_frame(char *data, size_t size, WebSocketFrame& frame, size_t max_payload) {
+    if (size < 2)
+        return 0;
+    auto byte = [data](size_t i) { return static_cast<unsigned char>(data[i]); };
+    frame.fin = byte(0) & 0x80;
+    frame.compressed = byte(0) & 0x40;
+    frame.opcode = byte(0) & 0x0f;
+    if ((byte(0) & 0x30) || !(byte(1) & 0x80))
+        return -1;
+    uint64_t length = byte(1) & 0x7f;
+    size_t offset = 2;
+    if (length == 126) {
+        if (size < 4)
+            return 0;
+        length = (byte(2) << 8) | byte(3);
+        offset = 4;
+    } else if (length == 127) {
+        if (size < 10)
+            return 0;
+        length = 0;
+        for (size_t i = 2; i < 10; i++)
+            length = (length << 8) | byte(i);
+        offset = 10;
+    }
+    if (frame.opcode >= WS_CLOSE && (length > 125 || !frame.fin || frame.compressed))
+        return -1;
+    if (length > max_payload)
+        return -2;
+    if (size - offset < 4 + length)
+        return 0;
+    unsigned char key[4];
+    std::memcpy(key, data + offset, sizeof(key));
+    offset += sizeof(key);
+    websocket_unmask(data + offset, length, key);
+    frame.payload = std::string_view(data + offset, length);
+    return offset + length;
+}
+
+// Function to build an (unmasked) server frame carrying `payload`
+std::string websocket_frame(uint8_t opcode, std::string_view payload, bool compressed = false) {
+    std::string frame;
+    frame.reserve(payload.size() + 10);
+    frame += static_cast<char>(0x80 | (compressed ? 0x40 : 0) | opcode);
+    if (payload.size() < 126) {
+        frame += static_cast<char>(payload.size());
+    } else if (payload.size() <= 0xffff) {
+        frame += static_cast<char>(126);
+        frame += static_cast<char>(payload.size() >> 8);
+        frame += static_cast<char>(payload.size() & 0xff);
+    } else {
+        frame += static_cast<char>(127);
+        for (int shift = 56; shift >= 0; shift -= 8)
+            frame += static_cast<char>((static_cast<uint64_t>(payload.size()) >> shift) & 0xff);
+    }
+    frame += payload;
+    return frame;
+}
+
+// Function to compress a message for permessage-deflate: raw deflate flushed to a byte boundary,
+// minus the empty stored block the flush ends with (RFC 7692 section 7.2.1); false on failure
+bool deflate_message(std::string_view message, std::string& output) {
+    z_stream stream{};
+    // Negative windowBits selects raw deflate, without the zlib header and trailer
+    if (deflateInit2(&stream, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    output.resize(deflateBound(&stream, message.size()) + 16);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(message.data()));
+    stream.avail_in = message.size();
+    stream.next_out = reinterpret_cast<Bytef*>(output.data());
+    stream.avail_out = output.size();
+    int result = deflate(&stream, Z_SYNC_FLUSH);
+    bool complete = result == Z_OK && stream.avail_in == 0 && stream.avail_out > 0;
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+    if (!complete || output.size() < 4)
+        return false;
+    output.resize(output.size() - 4);
+    return true;
+}
+
+// Function to decompress a permessage-deflate message of at most `limit` bytes; false if it is
+// corrupt or larger than that
+bool inflate_message(std::string_view message, std::string& output, size_t limit) {
+    static const char tail[] = {0x00, 0x00, '\xff', '\xff'};
+    z_stream stream{};
+    if (inflateInit2(&stream, -15) != Z_OK)
+        return false;
+    output.clear();
+    char chunk[16 * 1024];
+    bool ok = true;
+    for (std::string_view input : {message, std::string_view(tail, sizeof(tail))}) {
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+        stream.avail_in = input.size();
+        // A full chunk means inflate may have more to give
+        do {
+            stream.next_out = reinterpret_cast<Bytef*>(chunk);
+            stream.avail_out = sizeof(chunk);
+            int result = inflate(&stream, Z_SYNC_FLUSH);
+            output.append(chunk, sizeof(chunk) - stream.avail_out);
+            ok = (result == Z_OK || result == Z_BUF_ERROR || result == Z_STREAM_END) && output.size() <= limit;
+        } while (ok && stream.avail_out == 0);
+        if (!ok)
+            break;
+    }
+    inflateEnd(&stream);
+    return ok;
+}
+
+// Function to compute the Sec-WebSocket-Accept value for a client's Sec-WebSocket-Key
+std::string websocket_accept(std::string_view key) {
+    std::string input(key);
+    input += WEBSOCKET_GUID;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.size(), digest);
+    unsigned char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+    int length = EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+    return std::string(reinterpret_cast<char*>(encoded), length);
+}
+
+class WebSocketSession;
+
+// WebSocket message handler: called on the event loop for every complete message a session receives
+using WebSocketHandlerFunc = void(*)(WebSocketSession& session, std::string_view message, bool binary);
+
+// Broadcast Channel: the sessions of one route. broadcast() may be called from any thread; the
+// frame is built (and, if any subscriber negotiated deflate, compressed) once in the caller and
+// then queued to every subscriber on the event loop.
+class WebSocketChannel {
+public:
+    using Frame = std::shared_ptr<const std::string>;
+    void broadcast(std::string_view message, bool binary = false);
+    size_t subscribers() const { return count; }
+
+private:
+    friend class WebSocketSession;
+    task<> deliver(Frame plain, Frame compressed);
+    std::vector<WebSocketSession*> sessions;   // event loop thread only
+    std::atomic<size_t> count{0};
+    std::atomic<size_t> deflating{0};          // subscribers that negotiated permessage-deflate
+};
+
+// WebSocket route: the channel a session joins and the handler for the messages it receives
+struct WebSocketRoute {
+    WebSocketChannel *channel;
+    WebSocketHandlerFunc on_message;
+};
+
+// WebSocket session state; lives in the frame of its coroutine, on the event loop thread
+class WebSocketSession {
+public:
+    using Frame = WebSocketChannel::Frame;
+    WebSocketSession(ParkedConnection *conn, const WebSocketRoute& route, bool deflate)
+        : conn(conn), route(route), deflate(deflate) {}
+    task<> run();
+    // Function to send a message to this session alone (event loop thread only)
+    void send(std::string_view message, bool binary = false);
+    // Function to start the closing handshake; nothing is sent after the close frame
+    void close(uint16_t code);
+    const PeerAddress& peer() const { return conn->peer; }
+
+private:
+    friend class WebSocketChannel;
+    void queue(Frame frame);
+    bool flush();
+    bool read_available();
+    void receive(char *data, size_t size);
+    void handle(const WebSocketFrame& frame);
+    void join();
+    void leave();
+
+    ParkedConnection *conn;
+    WebSocketRoute route;
+    bool deflate;
+    std::deque<Frame> outbox;
+    size_t written = 0;                // bytes of the front frame already sent
+    size_t queued_bytes = 0;
+    std::string input;                 // an incomplete frame, until the rest arrives
+    std::string message;               // fragments of the message being received
+    uint8_t message_opcode = 0;        // 0 while no message is in progress
+    bool message_compressed = false;
+    EventLoop::Wait *waiting = nullptr;   // the wait run() is suspended in, to add EPOLLOUT to
+    bool closing = false;              // close frame queued: end once the outbox is written
+    bool failed = false;               // end without writing anything more
+    bool awaiting_pong = false;
+};
+
+// Every open session, so a drain can close them (event loop thread only)
+std::unordered_set<WebSocketSession*> websocket_sessions;
+
+void WebSocketChannel::broadcast(std::string_view message, bool binary) {
+    uint8_t opcode = binary ? WS_BINARY : WS_TEXT;
+    Frame plain = std::make_shared<const std::string>(websocket_frame(opcode, message));
+    Frame compressed;
+    std::string deflated;
+    if (deflating > 0 && message.size() >= WEBSOCKET_DEFLATE_MIN_SIZE && deflate_message(message, deflated) &&
+        deflated.size() < message.size())
+        compressed = std::make_shared<const std::string>(websocket_frame(opcode, deflated, true));
+    metrics.websocket_broadcasts++;
+    event_loop.spawn(deliver(std::move(plain), std::move(compressed)), true);
+}
+
+task<> WebSocketChannel::deliver(Frame plain, Frame compressed) {
+    for (WebSocketSession *session : sessions)
+        session->queue(session->deflate && compressed ? compressed : plain);
+    co_return;
+}
+
+void WebSocketSession::join() {
+    websocket_sessions.insert(this);
+    route.channel->sessions.push_back(this);
+    route.channel->count++;
+    if (deflate)
+        route.channel->deflating++;
+    metrics.websocket_sessions++;
+}
+
+void WebSocketSession::leave() {
+    websocket_sessions.erase(this);
+    std::vector<WebSocketSession*>& sessions = route.channel->sessions;
+    sessions.erase(std::find(sessions.begin(), sessions.end(), this));
+    route.channel->count--;
+    if (deflate)
+        route.channel->deflating--;
+    metrics.websocket_sessions--;
+}
+
+void WebSocketSession::send(std::string_view message, bool binary) {
+    uint8_t opcode = binary ? WS_BINARY : WS_TEXT;
+    std::string deflated;
+    if (deflate && message.size() >= WEBSOCKET_DEFLATE_MIN_SIZE && deflate_message(message, deflated) &&
+        deflated.size() < message.size())
+        queue(std::make_shared<const std::string>(websocket_frame(opcode, deflated, true)));
+    else
+        queue(std::make_shared<const std::string>(websocket_frame(opcode, message)));
+}
+
+void WebSocketSession::close(uint16_t code) {
+    const char payload[] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xff)};
+    queue(std::make_shared<const std::string>(websocket_frame(WS_CLOSE, {payload, sizeof(payload)})));
+    closing = true;
+}
+
+void WebSocketSession::queue(Frame frame) {
+    if (closing || failed)
+        return;
+    queued_bytes += frame->size();
+    outbox.push_back(std::move(frame));
+    // A client that does not keep up is dropped rather than buffered for without bound
+    if (outbox.size() > 1 && queued_bytes > WEBSOCKET_MAX_QUEUED_BYTES) {
+        metrics.websocket_slow_consumers++;
+        failed = true;
+    }
+    if (waiting && !(waiting->events & EPOLLOUT))
+        event_loop.rearm(waiting, waiting->events | EPOLLOUT);
+}
+
+// Function to write queued frames until the socket would block; false on error
+bool WebSocketSession::flush() {
+    while (!outbox.empty()) {
+        // A frame the socket did not take is retried with the same buffer, as TLS requires;
+        // a plaintext socket may take part of one
+        const std::string& frame = *outbox.front();
+        ERR_clear_error();
+        int n = transport_write(conn->ssl, conn->fd, frame.data() + written, frame.size() - written);
+        if (n <= 0) {
+            int error = transport_error(conn->ssl, n, true);
+            return error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ;
+        }
+        written += n;
+        if (written < frame.size())
+            continue;
+        written = 0;
+        queued_bytes -= frame.size();
+        outbox.pop_front();
+        metrics.websocket_frames_sent++;
+    }
+    return true;
+}
+
+// Function to read and handle everything the connection has; false once the client is gone
+bool WebSocketSession::read_available() {
+    BufferPool::Lease slab = buffer_pool.acquire();
+    while (!closing && !failed) {
+        ERR_clear_error();
+        int n = transport_read(conn->ssl, conn->fd, slab.data(), BufferPool::SLAB_SIZE);
+        if (n <= 0) {
+            int error = transport_error(conn->ssl, n, false);
+            return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+        }
+        awaiting_pong = false;
+        receive(slab.data(), n);
+    }
+    return true;
+}
+
+// Function to handle received bytes. Complete frames are handled straight from `data`; only a
+// trailing partial frame is copied, into `input`, until the rest of it arrives.
+void WebSocketSession::receive(char *data, size_t size) {
+    if (!input.empty()) {
+        input.append(data, size);
+        data = input.data();
+        size = input.size();
+    }
+    size_t offset = 0;
+    while (offset < size && !closing && !failed) {
+        WebSocketFrame frame;
+        long long used = parse_websocket_frame(data + offset, size - offset, frame, WEBSOCKET_MAX_MESSAGE_SIZE);
+        if (used < 0) {
+            close(used == -2 ? 1009 : 1002);
+            break;
+        }
+        if (used == 0)
+            break;
+        offset += used;
+        handle(frame);
+    }
+    if (closing || failed || offset == size)
+        std::string().swap(input);
+    else if (data == input.data())
+        input.erase(0, offset);
+    else
+        input.assign(data + offset, size - offset);
+}
+
+void WebSocketSession::handle(const WebSocketFrame& frame) {
+    switch (frame.opcode) {
+    case WS_PING:
+        queue(std::make_shared<const std::string>(websocket_frame(WS_PONG, frame.payload)));
+        return;
+    case WS_PONG:
+        return;
+    case WS_CLOSE:
+        // Answer with the client's status code and end once that is written
+        queue(std::make_shared<const std::string>(websocket_frame(WS_CLOSE, frame.payload.substr(0, 2))));
+        closing = true;
+        return;
+    case WS_TEXT:
+    case WS_BINARY:
+        if (message_opcode != 0 || (frame.compressed && !deflate)) {
+            close(1002);
+            return;
+        }
+        message_opcode = frame.opcode;
+        message_compressed = frame.compressed;
+        break;
+    case WS_CONTINUATION:
+        if (message_opcode == 0 || frame.compressed) {
+            close(1002);
+            return;
+        }
+        break;
+    default:
+        close(1002);
+        return;
+    }
+
+    if (message.size() + frame.payload.size() > WEBSOCKET_MAX_MESSAGE_SIZE) {
+        close(1009);
+        return;
+    }
+    message.append(frame.payload);
+    if (!frame.fin)
+        return;
+
+    std::string inflated;
+    if (message_compressed && !inflate_message(message, inflated, WEBSOCKET_MAX_MESSAGE_SIZE)) {
+        close(1009);
+        return;
+    }
+    bool binary = message_opcode == WS_BINARY;
+    std::string complete = std::move(message_compressed ? inflated : message);
+    message = std::string();
+    message_opcode = 0;
+    metrics.websocket_messages_received++;
+    try {
+        route.on_message(*this, complete, binary);
+    } catch (const std::exception& e) {
+        log(std::string("WebSocket handler failed: ") + e.what());
+        close(1011);
+    }
+}
+
+task<> WebSocketSession::run() {
+    // Frames are written as they are ready; Nagle would hold back the tail of every large one
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    join();
+    // Frames the client sent right behind its handshake
+    if (conn->buffered > 0)
+        receive(conn->buffer.data(), conn->buffered);
+    conn->buffer.reset();
+    conn->buffered = 0;
+
+    while (true) {
+        if (failed || !flush()) {
+            failed = true;
+            break;
+        }
+        if (closing && outbox.empty())
+            break;
+        uint32_t events = outbox.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+        EventLoop::Wait wait = event_loop.wait_io(conn->fd, events, std::chrono::milliseconds(WEBSOCKET_PING_INTERVAL_MS));
+        waiting = &wait;
+        bool ready = co_await wait;
+        waiting = nullptr;
+        if (abort_connections)
+            break;
+        if (!ready) {
+            // A quiet client is pinged; one that has not answered the last ping is gone
+            if (awaiting_pong || closing) {
+                metrics.websocket_timeouts++;
+                failed = true;
+                break;
+            }
+            queue(std::make_shared<const std::string>(websocket_frame(WS_PING, {})));
+            awaiting_pong = true;
+            continue;
+        }
+        if (!read_available())
+            failed = true;
+    }
+    leave();
+    finish_parked(conn, false, !failed && !abort_connections);
+}
+
+// Function to run a WebSocket session on the connection it was upgraded on
+task<> websocket_session(ParkedConnection *conn, WebSocketRoute route, bool deflate) {
+    WebSocketSession session(conn, route, deflate);
+    co_await session.run();
+}
+
+// Function to ask every WebSocket client to go away (status 1001) when a drain starts
+task<> close_websockets() {
+    for (WebSocketSession *session : websocket_sessions)
+        session->close(1001);
+    co_return;
+}
+
+// Function to answer a WebSocket upgrade request: the 101 response when `accepted`, otherwise
+// the error response to send instead. `deflate` says whether permessage-deflate was agreed on.
+std::string websocket_handshake(const RequestInfo& request_info, bool& accepted, bool& deflate) {
+    accepted = false;
+    deflate = false;
+    bool upgrade = false;
+    for_each_token(get_header(request_info, "Connection"), [&](std::string_view token) {
+        upgrade = iequals(token, "upgrade");
+        return !upgrade;
+    });
+    std::string_view key = get_header(request_info, "Sec-WebSocket-Key");
+    if (request_info.at("method") != "GET" || !upgrade || !iequals(get_header(request_info, "Upgrade"), "websocket") ||
+        key.empty() || get_header(request_info, "Sec-WebSocket-Version") != "13")
+        return "HTTP/1.1 426 Upgrade Required\r\nUpgrade: websocket\r\nSec-WebSocket-Version: 13\r\n"
+               "Content-Length: 0\r\n\r\n";
+    if (draining)
+        return "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+
+    // Offers that bound the server's window are declined; the server never keeps a window anyway
+    if (WEBSOCKET_DEFLATE) {
+        for_each_token(get_header(request_info, "Sec-WebSocket-Extensions"), [&](std::string_view offer) {
+            deflate = iequals(trim(offer.substr(0, offer.find(';'))), "permessage-deflate") &&
+                      offer.find("server_max_window_bits") == std::string_view::npos;
+            return !deflate;
+        });
+    }
+
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\n";
+    response += "Upgrade: websocket\r\n";
+    response += "Connection: Upgrade\r\n";
+    response += "Sec-WebSocket-Accept: " + websocket_accept(key) + "\r\n";
+    if (deflate)
+        response += "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; "
+                    "client_no_context_takeover\r\n";
+    response += "\r\n";
+    accepted = true;
+    return response;
+}
+
+// Server-Sent Events: a GET to a route in event_stream_routes is answered with a text/event-stream
+// response that stays open on the event loop, like a WebSocket session. EventStream::publish()
+// encodes an event once, already framed as an HTTP chunk, into a buffer that every subscriber
+// queues (HTTP/1.0 clients are sent the same bytes without the chunk framing). A subscriber with
+// sse_max_queued_events waiting either loses the oldest of them (sse_slow_consumer_policy "drop")
+// or is disconnected ("disconnect"). Quiet streams get a comment every sse_heartbeat_interval_ms,
+// which keeps intermediaries from timing them out and shows when a client is gone.
+class EventStreamSession;
+
+class EventStream {
+public:
+    // An encoded event: the event text inside its chunk framing
+    struct Encoded {
+        std::string bytes;
+        size_t text_offset;
+        size_t text_size;
+    };
+    using EventPtr = std::shared_ptr<const Encoded>;
+
+    // Function to send an event to every subscriber; may be called from any thread. `data` may
+    // span several lines; `event` and `id` are left out when empty.
+    void publish(std::string_view data, std::string_view event = {}, std::string_view id = {});
+    size_t subscribers() const { return count; }
+    static EventPtr encode(std::string_view text);
+
+private:
+    friend class EventStreamSession;
+    task<> deliver(EventPtr event);
+    std::vector<EventStreamSession*> sessions;   // event loop thread only
+    std::atomic<size_t> count{0};
+};
+
+// Event stream subscriber state; lives in the frame of its coroutine, on the event loop thread
+class EventStreamSession {
+public:
+    using EventPtr = EventStream::EventPtr;
+    EventStreamSession(ParkedConnection *conn, EventStream *stream, bool chunked)
+        : conn(conn), stream(stream), chunked(chunked) {}
+    task<> run();
+    // Function to end the stream once everything queued has been written
+    void close();
+
+private:
+    friend class EventStream;
+    void queue(EventPtr event);
+    void wake();
+    bool flush();
+    bool read_available();
+
+    ParkedConnection *conn;
+    EventStream *stream;
+    bool chunked;
+    std::deque<EventPtr> outbox;
+    bool writing = false;                 // the front event was partly attempted; TLS needs it retried as is
+    size_t written = 0;                   // bytes of the front event already sent
+    EventLoop::Wait *waiting = nullptr;   // the wait run() is suspended in, to add EPOLLOUT to
+    bool closing = false;
+    bool failed = false;
+};
+
+// Every open event stream, so a drain can end them (event loop thread only)
+std::unordered_set<EventStreamSession*> event_stream_sessions;
+
+EventStream::EventPtr EventStream::encode(std::string_view text) {
+    char size[16];
+    auto size_end = std::to_chars(size, size + sizeof(size), text.size(), 16).ptr;
+    auto event = std::make_shared<Encoded>();
+    event->bytes.reserve(text.size() + 16);
+    event->bytes.append(size, size_end);
+    event->bytes += "\r\n";
+    event->text_offset = event->bytes.size();
+    event->text_size = text.size();
+    event->bytes += text;
+    event->bytes += "\r\n";
+    return event;
+}
+
+void EventStream::publish(std::string_view data, std::string_view event, std::string_view id) {
+    std::string text;
+    text.reserve(data.size() + event.size() + id.size() + 32);
+    if (!event.empty())
+        text += "event: " + std::string(event) + "\n";
+    if (!id.empty())
+        text += "id: " + std::string(id) + "\n";
+    // Every line of the data gets its own "data:" field; the client joins them with newlines
+    while (true) {
+        size_t newline = data.find('\n');
+        std::string_view line = data.substr(0, newline);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        text += "data: ";
+        text += line;
+        text += "\n";
+        if (newline == std::string_view::npos)
+            break;
+        data.remove_prefix(newline + 1);
+    }
+    text += "\n";
+    metrics.sse_events_published++;
+    event_loop.spawn(deliver(encode(text)), true);
+}
+
+task<> EventStream::deliver(EventPtr event) {
+    for (EventStreamSession *session : sessions)
+        session->queue(event);
+    co_return;
+}
+
+void EventStreamSession::close() {
+    // The final chunk bypasses queue(): the slow-consumer policy must neither drop it nor
+    // disconnect a stream that is merely full. It goes after everything already queued.
+    static const EventPtr terminator =
+        std::make_shared<const EventStream::Encoded>(EventStream::Encoded{"0\r\n\r\n", 0, 0});
+    if (!closing && !failed && chunked) {
+        outbox.push_back(terminator);
+        wake();
+    }
+    closing = true;
+}
+
+void EventStreamSession::queue(EventPtr event) {
+    if (closing || failed)
+        return;
+    if (outbox.size() >= SSE_MAX_QUEUED_EVENTS) {
+        if (*SSE_SLOW_CONSUMER_POLICY.get() == "disconnect") {
+            metrics.sse_slow_consumers++;
+            failed = true;
+        } else {
+            // Drop the oldest event that no write has started on. When the only queued event is
+            // the one being written (sse_max_queued_events 1), the new event is dropped instead.
+            metrics.sse_events_dropped++;
+            size_t started = writing ? 1 : 0;
+            if (outbox.size() <= started)
+                return;
+            outbox.erase(outbox.begin() + started);
+        }
+    }
+    if (!failed)
+        outbox.push_back(std::move(event));
+    wake();
+}
+
+// Function to have run() write the outbox, or notice the failure, as soon as it can
+void EventStreamSession::wake() {
+    if (waiting && !(waiting->events & EPOLLOUT))
+        event_loop.rearm(waiting, waiting->events | EPOLLOUT);
+}
+
+// Function to write queued events until the socket would block; false on error
+bool EventStreamSession::flush() {
+    while (!outbox.empty()) {
+        const EventStream::Encoded& event = *outbox.front();
+        std::string_view bytes = chunked ? std::string_view(event.bytes)
+                                         : std::string_view(event.bytes).substr(event.text_offset, event.text_size);
+        if (written < bytes.size()) {
+            ERR_clear_error();
+            int n = transport_write(conn->ssl, conn->fd, bytes.data() + written, bytes.size() - written);
+            writing = true;
+            if (n <= 0) {
+                int error = transport_error(conn->ssl, n, true);
+                return error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ;
+            }
+            written += n;
+            if (written < bytes.size())
+                continue;
+        }
+        writing = false;
+        written = 0;
+        outbox.pop_front();
+    }
+    return true;
+}
+
+// Function to drain whatever the client sent (nothing is expected); false once it is gone
+bool EventStreamSession::read_available() {
+    BufferPool::Lease slab = buffer_pool.acquire();
+    while (true) {
+        ERR_clear_error();
+        int n = transport_read(conn->ssl, conn->fd, slab.data(), BufferPool::SLAB_SIZE);
+        if (n <= 0) {
+            int error = transport_error(conn->ssl, n, false);
+            return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+        }
+    }
+}
+
+task<> EventStreamSession::run() {
+    static const EventPtr heartbeat = EventStream::encode(":\n\n");
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    event_stream_sessions.insert(this);
+    stream->sessions.push_back(this);
+    stream->count++;
+    metrics.sse_subscribers++;
+    conn->buffer.reset();
+    conn->buffered = 0;
+
+    while (true) {
+        if (failed || !flush()) {
+            failed = true;
             break;
         }
-        auto colon_pos = line.find(':');
-        if (colon_pos != std::string::npos) {
-            std::string header_name = line.substr(0, colon_pos);
-            std::string header_value = line.substr(colon_pos + 1);
-            // Trim whitespace
-            header_value.erase(0, header_value.find_first_not_of(" \t"));
-            header_value.erase(header_value.find_last_not_of(" \t\r\n") + 1);
-            request_info[header_name] = header_value;
+        if (closing && outbox.empty())
+            break;
+        uint32_t events = outbox.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+        EventLoop::Wait wait = event_loop.wait_io(conn->fd, events, std::chrono::milliseconds(SSE_HEARTBEAT_INTERVAL_MS));
+        waiting = &wait;
+        bool ready = co_await wait;
+        waiting = nullptr;
+        if (abort_connections)
+            break;
+        if (!ready) {
+            // A client that took nothing for a whole interval is not reading any more
+            if (!outbox.empty()) {
+                metrics.connection_timeouts[Connection::WRITE]++;
+                failed = true;
+                break;
+            }
+            queue(heartbeat);
+            continue;
         }
+        if (!read_available())
+            failed = true;
     }
 
-    // Read the body
-    std::string body;
-    std::getline(request_stream, body, '\0'); // Read until EOF
-    request_info["body"] = body;
+    event_stream_sessions.erase(this);
+    stream->sessions.erase(std::find(stream->sessions.begin(), stream->sessions.end(), this));
+    stream->count--;
+    metrics.sse_subscribers--;
+    finish_parked(conn, false, !failed && !abort_connections);
+}
 
-    return request_info;
+// Function to run an event stream subscriber on the connection its response was started on
+task<> event_stream_session(ParkedConnection *conn, EventStream *stream, bool chunked) {
+    EventStreamSession session(conn, stream, chunked);
+    co_await session.run();
 }
 
-// Function to get the MIME type based on file extension
-std::string get_mime_type(const std::string& path) {
-    if (path.ends_with(".html") || path.ends_with(".htm"))
-        return "text/html";
-    else if (path.ends_with(".css"))
-        return "text/css";
-    else if (path.ends_with(".js"))
-        return "application/javascript";
-    else if (path.ends_with(".json"))
-        return "application/json";
-    else if (path.ends_with(".png"))
-        return "image/png";
-    else if (path.ends_with(".jpg") || path.ends_with(".jpeg"))
-        return "image/jpeg";
-    else if (path.ends_with(".gif"))
-        return "image/gif";
-    else
-        return "application/octet-stream";
+// Function to end every event stream when a drain starts
+task<> close_event_streams() {
+    for (EventStreamSession *session : event_stream_sessions)
+        session->close();
+    co_return;
 }
 
-// Function to handle 404 Not Found
-std::string not_found_response() {
-    std::string body = "<html><body><h1>404 Not Found</h1></body></html>";
-    std::string response;
-    response = "HTTP/1.1 404 Not Found\r\n";
-    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
-    response += "Content-Type: text/html\r\n";
-    response += "Connection: close\r\n";
+// Function to start a text/event-stream response: the headers to send when `accepted`,
+// otherwise the error response to send instead. `chunked` says how events are framed.
+std::string event_stream_response(const RequestInfo& request_info, bool& accepted, bool& chunked) {
+    accepted = false;
+    chunked = request_info.at("version") == "HTTP/1.1";
+    if (request_info.at("method") != "GET")
+        return "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\n\r\n";
+    if (draining)
+        return "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+    std::string response = "HTTP/1.1 200 OK\r\n";
+    response += "Content-Type: text/event-stream\r\n";
+    response += "Cache-Control: no-cache\r\n";
+    response += chunked ? "Transfer-Encoding: chunked\r\n" : "Connection: close\r\n";
     response += "\r\n";
-    response += body;
+    accepted = true;
     return response;
 }
 
 // Function to handle root path
-std::string handle_root(const std::unordered_map<std::string, std::string>& request_info) {
+void handle_root(const RequestInfo& request_info, ResponseWriter& writer) {
     // Serve index.html
-    std::string full_path = WEB_ROOT + "/index.html";
-    std::string body;
-    std::string response;
-
-    if (fs::exists(full_path) && !fs::is_directory(full_path)) {
-        // Serve the file
-        std::ifstream file(full_path, std::ios::binary);
-        if (file) {
-            body.assign((std::istreambuf_iterator<char>(file)),
-                         std::istreambuf_iterator<char>());
-            std::string content_type = get_mime_type(full_path);
-
-            response = "HTTP/1.1 200 OK\r\n";
-            response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
-            response += "Content-Type: " + content_type + "\r\n";
-            response += "Connection: close\r\n";
-            response += "\r\n";
-            response += body;
-        } else {
-            response = not_found_response();
-        }
-    } else {
-        response = not_found_response();
-    }
-
-    return response;
+    std::pmr::string full_path(*WEB_ROOT.get(), request_memory());
+    full_path += "/index.html";
+    std::string response = serve_file(full_path, request_info, &writer);
+    if (!response.empty())
+        writer.send_raw(response);
 }
 
 // Function to handle /about path
-std::string handle_about(const std::unordered_map<std::string, std::string>& request_info) {
+std::string handle_about(const RequestInfo& request_info) {
     std::string body = "<html><body><h1>About Us</h1><p>This is the about page.</p></body></html>";
     std::string response = "HTTP/1.1 200 OK\r\n";
     response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
     response += "Content-Type: text/html\r\n";
-    response += "Connection: close\r\n";
+    response += "Cache-Control: public, max-age=60\r\n";
     response += "\r\n";
     response += body;
     return response;
 }
 
 // Function to handle POST requests
-std::string handle_post(const std::unordered_map<std::string, std::string>& request_info) {
+std::string handle_post(const RequestInfo& request_info) {
     // For demonstration, echo back the received data
-    std::string received_data = request_info.at("body");
+    std::string received_data(request_info.at("body"));
     std::string body = "<html><body><h1>POST Data Received</h1><pre>" + received_data + "</pre></body></html>";
     std::string response = "HTTP/1.1 200 OK\r\n";
     response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
     response += "Content-Type: text/html\r\n";
-    response += "Connection: close\r\n";
     response += "\r\n";
     response += body;
     return response;
 }
 
+// Function to render all server metrics in Prometheus text format
+std::string render_metrics() {
+    auto counter = [](const std::string& name, uint64_t value) {
+        return name + " " + std::to_string(value) + "\n";
+    };
+    uint64_t bytes_in = metrics.compression_bytes_in;
+    uint64_t bytes_out = metrics.compression_bytes_out;
+
+    std::string body;
+    body += counter("compressed_responses_total", metrics.compressed_responses);
+    body += counter("compression_bytes_in_total", bytes_in);
+    body += counter("compression_bytes_out_total", bytes_out);
+    body += counter("compression_bytes_saved_total", bytes_in > bytes_out ? bytes_in - bytes_out : 0);
+    body += counter("compression_cache_hits_total", metrics.compression_cache_hits);
+    body += counter("compression_cache_misses_total", metrics.compression_cache_misses);
+    body += counter("not_modified_responses_total", metrics.not_modified_responses);
+    body += counter("partial_responses_total", metrics.partial_responses);
+    body += counter("open_file_cache_hits_total", metrics.open_file_cache_hits);
+    body += counter("open_file_cache_negative_hits_total", metrics.open_file_cache_negative_hits);
+    body += counter("open_file_cache_misses_total", metrics.open_file_cache_misses);
+    body += counter("content_cache_hits_total", metrics.content_cache_hits);
+    body += counter("content_cache_misses_total", metrics.content_cache_misses);
+    body += counter("web_root_watcher_events_total", metrics.watcher_invalidations);
+    body += counter("requests_total", metrics.requests);
+    body += counter("request_arena_bytes_total", metrics.request_arena_bytes);
+#ifdef COUNT_HEAP_ALLOCATIONS
+    body += counter("request_heap_allocations_total", metrics.request_heap_allocations);
+    body += counter("request_heap_bytes_total", metrics.request_heap_bytes);
+#endif
+    body += counter("keepalive_requests_total", metrics.keepalive_requests);
+    body += counter("io_buffers_in_use", buffer_pool.in_use());
+    body += counter("connections_reaped_total", metrics.connections_reaped);
+    body += counter("accept_queue_length", metrics.accept_queue_length);
+    body += counter("proxy_protocol_headers_total{version=\"1\"}", metrics.proxy_protocol_headers[0]);
+    body += counter("proxy_protocol_headers_total{version=\"2\"}", metrics.proxy_protocol_headers[1]);
+    body += counter("proxy_protocol_errors_total", metrics.proxy_protocol_errors);
+    body += counter("proxy_protocol_untrusted_total", metrics.proxy_protocol_untrusted);
+    body += counter("tcp_fastopen_connections_total", metrics.tcp_fastopen_connections);
+    for (const Listener& listener : listeners)
+        body += counter("listener_connections_total{listener=\"" + listener.name + "\",mode=\"" +
+                        Listener::MODE_NAMES[listener.mode] + "\"}", listener.accepted);
+    body += counter("rate_limited_total{scope=\"connection\"}", metrics.rate_limited[RateLimiter::CONNECTIONS]);
+    body += counter("rate_limited_total{scope=\"request\"}", metrics.rate_limited[RateLimiter::REQUESTS]);
+    body += counter("rate_limit_evictions_total", metrics.rate_limit_evictions);
+    body += counter("config_reloads_total", metrics.config_reloads);
+    body += counter("worker_threads", metrics.worker_threads);
+    body += counter("worker_busy_percent", metrics.worker_busy_percent);
+    body += counter("pool_resizes_total{direction=\"grow\"}", metrics.pool_grows);
+    body += counter("pool_resizes_total{direction=\"shrink\"}", metrics.pool_shrinks);
+    body += counter("config_reload_failures_total", metrics.config_reload_failures);
+    body += counter("async_handlers_total", metrics.async_handlers);
+    body += counter("async_handlers_in_flight", event_loop.in_flight());
+    body += counter("proxy_requests_total", metrics.proxy_requests);
+    body += counter("proxy_errors_total", metrics.proxy_errors);
+    body += counter("upstream_connections_opened_total", metrics.upstream_connections_opened);
+    body += counter("upstream_connections_reused_total", metrics.upstream_connections_reused);
+    body += counter("response_cache_hits_total", metrics.response_cache_hits);
+    body += counter("response_cache_misses_total", metrics.response_cache_misses);
+    body += counter("response_cache_coalesced_total", metrics.response_cache_coalesced);
+    body += counter("response_cache_stores_total", metrics.response_cache_stores);
+    body += counter("response_cache_admission_rejects_total", metrics.response_cache_rejected);
+    body += counter("response_cache_evictions_total", metrics.response_cache_evictions);
+    body += counter("response_cache_bytes", response_cache.bytes());
+    body += counter("websocket_sessions", metrics.websocket_sessions);
+    body += counter("websocket_messages_received_total", metrics.websocket_messages_received);
+    body += counter("websocket_frames_sent_total", metrics.websocket_frames_sent);
+    body += counter("websocket_broadcasts_total", metrics.websocket_broadcasts);
+    body += counter("websocket_slow_consumer_disconnects_total", metrics.websocket_slow_consumers);
+    body += counter("websocket_ping_timeouts_total", metrics.websocket_timeouts);
+    body += counter("sse_subscribers", metrics.sse_subscribers);
+    body += counter("sse_events_published_total", metrics.sse_events_published);
+    body += counter("sse_events_dropped_total", metrics.sse_events_dropped);
+    body += counter("sse_slow_consumer_disconnects_total", metrics.sse_slow_consumers);
+    for (const auto& [name, upstream] : upstreams) {
+        for (const Upstream::Backend& backend : upstream->backends) {
+            std::string labels = "{upstream=\"" + name + "\",server=\"" + backend.address + "\"}";
+            body += counter("upstream_healthy" + labels, backend.healthy);
+            body += counter("upstream_outstanding_requests" + labels, backend.outstanding);
+        }
+    }
+    body += counter("accept_queue_shed_total{reason=\"full\"}", metrics.accept_queue_shed[SHED_QUEUE_FULL]);
+    body += counter("accept_queue_shed_total{reason=\"codel\"}", metrics.accept_queue_shed[SHED_CODEL]);
+    for (size_t i = 0; i < std::size(Metrics::SOJOURN_BUCKETS_MS); i++) {
+        body += counter("accept_queue_sojourn_milliseconds_bucket{le=\"" +
+                        std::to_string(Metrics::SOJOURN_BUCKETS_MS[i]) + "\"}", metrics.sojourn_buckets[i]);
+    }
+    body += counter("accept_queue_sojourn_milliseconds_bucket{le=\"+Inf\"}", metrics.sojourn_count);
+    body += counter("accept_queue_sojourn_milliseconds_sum", metrics.sojourn_us_total / 1000);
+    body += counter("accept_queue_sojourn_milliseconds_count", metrics.sojourn_count);
+    for (int phase = 0; phase < Connection::PHASES; phase++) {
+        body += counter(std::string("connection_timeouts_total{phase=\"") +
+                        Connection::PHASE_NAMES[phase] + "\"}", metrics.connection_timeouts[phase]);
+    }
+    return body;
+}
+
+// Function to handle /metrics path
+std::string handle_metrics(const RequestInfo&) {
+    std::string body = render_metrics();
+    std::string response = "HTTP/1.1 200 OK\r\n";
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    response += "Content-Type: text/plain; version=0.0.4\r\n";
+    response += "\r\n";
+    response += body;
+    return response;
+}
+
+// Function to handle /stream path: demonstrates a body generated piece by piece
+void handle_stream(const RequestInfo&, ResponseWriter& writer) {
+    writer.begin("200 OK", "text/html");
+    writer.write("<html><body><h1>Streaming Response</h1><ul>");
+    for (int i = 1; i <= 10 && !writer.failed(); ++i)
+        writer.write("<li>Chunk " + std::to_string(i) + "</li>");
+    writer.write("</ul></body></html>");
+}
+
+// Function to handle /slow path: a coroutine handler that waits a second without holding a worker
+task<Response> handle_slow(AsyncRequest) {
+    co_await event_loop.sleep_for(std::chrono::milliseconds(1000));
+    Response response;
+    response.body = "<html><body><h1>Slow Response</h1><p>Waited one second.</p></body></html>";
+    co_return response;
+}
+
+// Chat Channel: every message a /chat client sends goes to all /chat clients, and text messages
+// also to /events subscribers
+WebSocketChannel chat_channel;
+EventStream chat_events;
+
+// Function to handle /chat messages: a WebSocket example that broadcasts what it receives
+void handle_chat(WebSocketSession&, std::string_view message, bool binary) {
+    chat_channel.broadcast(message, binary);
+    if (!binary)
+        chat_events.publish(message, "chat");
+}
+
 // Define a Handler Function Type
-using HandlerFunc = std::string(*)(const std::unordered_map<std::string, std::string>&);
+using HandlerFunc = std::string(*)(const RequestInfo&);
+
+// Streaming handlers write their response through a ResponseWriter as it is produced
+using StreamHandlerFunc = void(*)(const RequestInfo&, ResponseWriter&);
 
-// Routing Table
-std::unordered_map<std::string, HandlerFunc> routes;
+// Routing Tables
+std::unordered_map<std::string, HandlerFunc, StringHash, std::equal_to<>> routes;
+std::unordered_map<std::string, StreamHandlerFunc, StringHash, std::equal_to<>> stream_routes;
+std::unordered_map<std::string, AsyncHandlerFunc, StringHash, std::equal_to<>> async_routes;
+std::unordered_map<std::string, WebSocketRoute, StringHash, std::equal_to<>> websocket_routes;
+std::unordered_map<std::string, EventStream*, StringHash, std::equal_to<>> event_stream_routes;
 
 // Initialize Routes
 void initialize_routes() {
-    routes["/"] = handle_root;
+    stream_routes["/"] = handle_root;
     routes["/about"] = handle_about;
+    routes["/metrics"] = handle_metrics;
+    stream_routes["/stream"] = handle_stream;
+    async_routes["/slow"] = handle_slow;
+    websocket_routes["/chat"] = {&chat_channel, handle_chat};
+    event_stream_routes["/events"] = &chat_events;
     // Add more routes as needed
 }
 
-// Function to generate the HTTP response
-std::string generate_response(const std::unordered_map<std::string, std::string>& request_info) {
-    std::string method = request_info.at("method");
-    std::string path = request_info.at("path");
+// Function to generate the HTTP response. Streaming routes and large static files are written
+// through the writer instead, in which case the returned string is empty.
+std::string generate_response(const RequestInfo& request_info, ResponseWriter& writer) {
+    const auto& method = request_info.at("method");
+    std::string_view path = request_info.at("path");
 
     // Handle POST requests
     if (method == "POST") {
         return handle_post(request_info);
     }
 
-    // Check if the path is in the routing table
-    if (routes.find(path) != routes.end()) {
-        return routes[path](request_info);
+    // Check if the path is in the routing tables
+    if (auto route = routes.find(path); route != routes.end()) {
+        // Handler responses that allow it are served from the response cache; concurrent
+        // misses wait for the first one instead of all running the handler
+        auto header = [&request_info](std::string_view name) { return get_header(request_info, name); };
+        ResponseCache::Ticket ticket = lookup_response(request_info);
+        if (ticket.waiting())
+            ticket.hit = response_cache.wait(ticket, header, std::chrono::milliseconds(RESPONSE_CACHE_LOCK_TIMEOUT_MS));
+        if (ticket.hit)
+            return ResponseCache::render(*ticket.hit, false);
+        std::string response = route->second(request_info);
+        response_cache.fill(ticket, response, header);
+        return response;
+    } else if (auto stream_route = stream_routes.find(path); stream_route != stream_routes.end()) {
+        stream_route->second(request_info, writer);
+        return "";
     } else {
         // Serve static files or return 404
-        std::string full_path = WEB_ROOT + path;
-        std::string response;
-        std::string body;
-        std::string content_type;
-
-        if (fs::exists(full_path) && !fs::is_directory(full_path)) {
-            // Serve the file
-            std::ifstream file(full_path, std::ios::binary);
-            if (file) {
-                body.assign((std::istreambuf_iterator<char>(file)),
-                             std::istreambuf_iterator<char>());
-                content_type = get_mime_type(full_path);
-
-                response = "HTTP/1.1 200 OK\r\n";
-                response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
-                response += "Content-Type: " + content_type + "\r\n";
-                response += "Connection: close\r\n";
-                response += "\r\n";
-                response += body;
-            } else {
-                response = not_found_response();
-            }
-        } else {
-            response = not_found_response();
-        }
-
-        return response;
+        std::pmr::string full_path(*WEB_ROOT.get(), request_memory());
+        full_path += path;
+        return serve_file(full_path, request_info, &writer);
     }
 }
 
-// Function to handle each client connection
-void handle_client(int client_socket, SSL_CTX *ctx) {
-    SSL *ssl = SSL_new(ctx);
-    SSL_set_fd(ssl, client_socket);
+// Function to decide whether the client allows the connection to stay open after this request
+bool wants_keep_alive(const RequestInfo& request_info) {
+    bool keep_alive = request_info.at("version") == "HTTP/1.1";
+    for_each_token(get_header(request_info, "Connection"), [&](std::string_view token) {
+        if (iequals(token, "close"))
+            keep_alive = false;
+        else if (iequals(token, "keep-alive"))
+            keep_alive = true;
+        return true;
+    });
+    return keep_alive;
+}
 
-    if (SSL_accept(ssl) <= 0) {
-        ERR_print_errors_fp(stderr);
+// Function to build the answer of a redirect listener: the same URL over HTTPS on `https_port`.
+// GET and HEAD get a 301; other methods a 308, so that clients repeat them with their body.
+std::string https_redirect(const RequestInfo& request_info, int https_port) {
+    std::string_view host = get_header(request_info, "Host");
+    // Drop the port the client used, but not the colons of a bracketed IPv6 literal
+    size_t colon = host.rfind(':');
+    if (colon != std::string_view::npos && host.find(']', colon) == std::string_view::npos)
+        host = host.substr(0, colon);
+    bool valid_host = !host.empty() && std::none_of(host.begin(), host.end(), [](char c) {
+        return c <= ' ' || c == '/' || c == '\\' || c == '@' || c == 0x7f;
+    });
+    if (!valid_host)
+        return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+
+    std::string_view target = request_info.at("path");
+    std::string location = "https://" + std::string(host);
+    if (https_port != 443)
+        location += ":" + std::to_string(https_port);
+    location += target.starts_with('/') ? target : "/";
+    const auto& method = request_info.at("method");
+    bool safe = method == "GET" || method == "HEAD";
+    std::string response = safe ? "HTTP/1.1 301 Moved Permanently\r\n" : "HTTP/1.1 308 Permanent Redirect\r\n";
+    response += "Location: " + location + "\r\n";
+    response += "Content-Length: 0\r\n";
+    response += "\r\n";
+    return response;
+}
+
+// Function to wait until the client sends more data on an idle connection; false on timeout
+bool wait_for_request(Connection& conn) {
+    if (conn.buffered > 0 || transport_pending(conn.ssl) > 0)
+        return true;
+    conn.arm(Connection::KEEPALIVE, KEEPALIVE_TIMEOUT_MS);
+    // Idle connections are closed when a drain starts; one that went idle just after must see it
+    if (draining)
+        return false;
+    pollfd pfd{conn.fd, POLLIN, 0};
+    return poll(&pfd, 1, -1) > 0 && !conn.timed_out();
+}
+
+// Function to handle each client connection. Requests are served one after another until the
+// client closes, stops sending for KEEPALIVE_TIMEOUT_MS, or reaches KEEPALIVE_MAX_REQUESTS.
+void handle_client(int client_socket, const PeerAddress& peer, const Listener *listener,
+                   ParkedConnection *resumed) {
+    // Plaintext and redirect listeners have no handshake; their connections never get an SSL
+    bool handshake_done = resumed != nullptr || listener->mode != Listener::TLS;
+    SSL *ssl = resumed ? resumed->ssl : listener->mode == Listener::TLS ? SSL_new(listener->ctx) : nullptr;
+    Connection conn(client_socket, ssl);
+    conn.peer = peer;
+    conn.listener = listener;
+    int first_request = 0;
+    bool refused = false;
+
+    if (resumed) {
+        // Back from a coroutine handler: pick up where the keep-alive loop left off
+        conn.buffer = std::move(resumed->buffer);
+        conn.buffered = resumed->buffered;
+        first_request = resumed->served;
+        delete resumed;
     } else {
-        // Read the request using SSL_read
-        std::string request = ssl_read_request(ssl);
+        conn.arm(Connection::HANDSHAKE, HANDSHAKE_TIMEOUT_MS);
+        // Behind a balancer the PROXY header comes first and names the client; its connection
+        // rate is checked here instead of at accept, still before any TLS work
+        if (listener->proxy_protocol)
+            refused = !read_proxy_header(conn) || !rate_limiter.allow(conn.peer, RateLimiter::CONNECTIONS);
+        if (ssl)
+            SSL_set_fd(ssl, client_socket);
+    }
+    bool parked = false;
+    if (refused || (!handshake_done && SSL_accept(ssl) <= 0)) {
+        if (!refused && !conn.timed_out())
+            ERR_print_errors_fp(stderr);
+    } else {
+        for (int served = first_request; served < KEEPALIVE_MAX_REQUESTS; served++) {
+            if (served > 0 && !wait_for_request(conn))
+                break;
+            conn.arm(Connection::HEADER, HEADER_TIMEOUT_MS);
 
-        if (request.empty()) {
-            SSL_shutdown(ssl);
-            SSL_free(ssl);
-            close(client_socket);
-            return;
-        }
+            uint64_t heap_allocations = thread_heap_allocations;
+            uint64_t heap_bytes = thread_heap_bytes;
+            bool reusable = false;
+            {
+                // Read the request using SSL_read
+                std::pmr::string request = ssl_read_request(conn);
+                if (request.empty()) {
+                    request_arena.reset();
+                    break;
+                }
+                conn.disarm();
 
-        // Parse the request
-        auto request_info = parse_request(request);
+                // Parse the request
+                auto request_info = parse_request(request);
 
-        // Generate the response
-        std::string response = generate_response(request_info);
+                // Generate the response, streaming it if the handler asked to
+                bool keep_alive = wants_keep_alive(request_info) && served + 1 < KEEPALIVE_MAX_REQUESTS &&
+                                  !draining;
+                ResponseWriter writer(conn, request_info["version"] == "HTTP/1.1", keep_alive);
+                bool sent;
+                if (!rate_limiter.allow(conn.peer, RateLimiter::REQUESTS)) {
+                    static const char too_many_requests[] = "HTTP/1.1 429 Too Many Requests\r\n"
+                                                            "Retry-After: 1\r\n"
+                                                            "Content-Length: 0\r\n\r\n";
+                    sent = writer.send_raw({too_many_requests, sizeof(too_many_requests) - 1});
+                } else if (listener->mode == Listener::REDIRECT) {
+                    sent = writer.send_raw(https_redirect(request_info, listener->redirect_port));
+                } else if (auto websocket = websocket_routes.find(std::string_view(request_info["path"]));
+                           websocket != websocket_routes.end()) {
+                    // An accepted upgrade hands the connection to a WebSocket session on the
+                    // event loop for good
+                    bool accepted, deflate;
+                    std::string response = websocket_handshake(request_info, accepted, deflate);
+                    if (!accepted) {
+                        sent = writer.send_raw(response);
+                    } else if ((sent = conn.write(response.data(), response.size()))) {
+                        ParkedConnection *moved = park_connection(conn, false, served + 1);
+                        event_loop.spawn(websocket_session(moved, websocket->second, deflate), true);
+                        parked = true;
+                    }
+                } else if (auto stream = event_stream_routes.find(std::string_view(request_info["path"]));
+                           stream != event_stream_routes.end()) {
+                    // The response stays open on the event loop, carrying events as they are published
+                    bool accepted, chunked;
+                    std::string response = event_stream_response(request_info, accepted, chunked);
+                    if (!accepted) {
+                        sent = writer.send_raw(response);
+                    } else if ((sent = conn.write(response.data(), response.size()))) {
+                        ParkedConnection *moved = park_connection(conn, false, served + 1);
+                        event_loop.spawn(event_stream_session(moved, stream->second, chunked), true);
+                        parked = true;
+                    }
+                } else if (Upstream *upstream = find_proxy_route(request_info["path"]);
+                           upstream || async_routes.contains(std::string_view(request_info["path"]))) {
+                    // The event loop produces the response and hands the connection back
+                    // afterwards, unless the response cache already has it
+                    ResponseCache::Ticket ticket = lookup_response(request_info);
+                    if (ticket.hit) {
+                        sent = writer.send_raw(ResponseCache::render(*ticket.hit, false));
+                    } else {
+                        ParkedConnection *moved = park_connection(conn, keep_alive, served + 1);
+                        AsyncRequest request = copy_request(request_info);
+                        if (upstream) {
+                            event_loop.spawn(serve_proxy(moved, upstream, std::move(request), std::move(ticket)));
+                        } else {
+                            AsyncHandlerFunc handler = async_routes.find(std::string_view(request_info["path"]))->second;
+                            event_loop.spawn(serve_async(moved, handler, std::move(request), std::move(ticket)));
+                        }
+                        parked = true;
+                        sent = true;
+                    }
+                } else {
+                    std::string response = generate_response(request_info, writer);
 
-        // Send the response using SSL_write
-        ssize_t bytes_sent = SSL_write(ssl, response.c_str(), response.size());
-        if (bytes_sent <= 0) {
-            log("Failed to send response to client.");
-        }
+                    // Send the response using SSL_write
+                    if (writer.started()) {
+                        sent = writer.end();
+                    } else {
+                        sent = writer.send_raw(response);
+                    }
+                }
+                if (!sent) {
+                    log("Failed to send response to client.");
+                }
+                reusable = writer.reusable();
+
+                // Log the request
+                char thread_id[24];
+                auto id_end = std::to_chars(thread_id, thread_id + sizeof(thread_id),
+                                            std::hash<std::thread::id>{}(std::this_thread::get_id())).ptr;
+                std::pmr::string message(request_memory());
+                message += "[";
+                message += request_info["method"];
+                message += "] ";
+                message += request_info["path"];
+                char client[INET6_ADDRSTRLEN];
+                message += " - Client: ";
+                message.append(client, conn.peer.format(client, sizeof(client)));
+                message += " - Thread: ";
+                message.append(thread_id, id_end);
+                log(message);
+            }
+
+            // Everything request-scoped lived in the arena; account for it and drop it in one go
+            metrics.requests++;
+            if (served > 0)
+                metrics.keepalive_requests++;
+            metrics.request_arena_bytes += request_arena.bytes_used();
+            metrics.request_heap_allocations += thread_heap_allocations - heap_allocations;
+            metrics.request_heap_bytes += thread_heap_bytes - heap_bytes;
+            request_arena.reset();
 
-        // Log the request
-        log("[" + request_info["method"] + "] " + request_info["path"] + " - Thread: " +
-            std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())));
+            if (parked || !reusable)
+                break;
+        }
     }
 
-    SSL_shutdown(ssl);
+    conn.disarm();
+    if (parked)
+        return;
+    if (conn.timed_out()) {
+        // The socket is already shut down, so there is no point in a TLS close_notify
+        metrics.connection_timeouts[conn.phase]++;
+    } else if (ssl) {
+        SSL_shutdown(ssl);
+    }
+    conn.buffer.reset();
     SSL_free(ssl);
     close(client_socket);
 }
 
-int main() {
-    // Open log file
-    log_file.open("server.log", std::ios::app);
-    if (!log_file.is_open()) {
-        std::cerr << "Failed to open log file." << std::endl;
-        return -1;
+// Pool Controller: with adaptive_threads on, sizes the thread pool between min_threads and
+// max_threads. Busy workers are sampled every SAMPLE_MS; once per INTERVAL_MS the pool grows by
+// a quarter when connections wait longer than adaptive_target_wait_ms in the queue or nearly
+// every worker is busy, and shrinks by one only after SHRINK_AFTER quiet intervals in a row.
+// Every decision is logged with the numbers behind it.
+class PoolController {
+public:
+    void start(ThreadPool *pool);
+    void stop();
+
+private:
+    static const int SAMPLE_MS = 100;
+    static const int INTERVAL_MS = 1000;
+    static const int SHRINK_AFTER = 5;
+    static constexpr double GROW_BUSY_RATIO = 0.9;
+    static constexpr double SHRINK_BUSY_RATIO = 0.5;
+    void run();
+    void decide(double busy_ratio, std::chrono::milliseconds wait);
+    ThreadPool *pool = nullptr;
+    int quiet_intervals = 0;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+    std::thread thread;
+};
+
+void PoolController::start(ThreadPool *target_pool) {
+    pool = target_pool;
+    stopping = false;
+    thread = std::thread([this] { run(); });
+}
+
+void PoolController::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
     }
+    wakeup.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
 
-    // Read configuration file
-    std::ifstream config_file("config.json");
-    if (!config_file.is_open()) {
-        log("Failed to open config.json");
-        return -1;
+void PoolController::run() {
+    double busy_sum = 0;
+    int samples = 0;
+    std::chrono::steady_clock::duration oldest_wait{};
+    uint64_t sojourn_count = metrics.sojourn_count;
+    uint64_t sojourn_us = metrics.sojourn_us_total;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!wakeup.wait_for(lock, std::chrono::milliseconds(SAMPLE_MS), [this] { return stopping; })) {
+        ThreadPool::Stats stats = pool->stats();
+        metrics.worker_threads = stats.workers;
+        busy_sum += double(stats.busy) / std::max<size_t>(1, stats.workers);
+        oldest_wait = std::max(oldest_wait, stats.oldest_wait);
+        if (++samples < INTERVAL_MS / SAMPLE_MS)
+            continue;
+
+        // Queue wait: the mean of connections picked up in this interval, or the age of one
+        // still waiting if that is worse (with every worker stuck nothing gets picked up)
+        uint64_t count = metrics.sojourn_count - sojourn_count;
+        uint64_t waited_us = metrics.sojourn_us_total - sojourn_us;
+        auto wait = std::max(std::chrono::milliseconds(count ? waited_us / count / 1000 : 0),
+                             std::chrono::duration_cast<std::chrono::milliseconds>(oldest_wait));
+        double busy_ratio = busy_sum / samples;
+        metrics.worker_busy_percent = uint64_t(busy_ratio * 100);
+        if (ADAPTIVE_THREADS)
+            decide(busy_ratio, wait);
+
+        busy_sum = 0;
+        samples = 0;
+        oldest_wait = {};
+        sojourn_count += count;
+        sojourn_us += waited_us;
     }
+}
 
-    json config;
-    config_file >> config;
+void PoolController::decide(double busy_ratio, std::chrono::milliseconds wait) {
+    size_t current = pool->size();
+    size_t min_threads = std::max(1, MIN_THREADS.load());
+    size_t max_threads = std::max<size_t>(min_threads, MAX_THREADS);
+    size_t next = std::clamp(current, min_threads, max_threads);
 
-    PORT = config.value("port", 8080);
-    MAX_THREADS = config.value("max_threads", 4);
-    WEB_ROOT = config.value("web_root", "./www");
+    if (wait.count() > ADAPTIVE_TARGET_WAIT_MS || busy_ratio > GROW_BUSY_RATIO) {
+        quiet_intervals = 0;
+        next = std::min(max_threads, current + std::max<size_t>(1, current / 4));
+    } else if (wait.count() == 0 && busy_ratio < SHRINK_BUSY_RATIO) {
+        if (++quiet_intervals >= SHRINK_AFTER && current > min_threads) {
+            quiet_intervals = 0;
+            next = current - 1;
+        }
+    } else {
+        quiet_intervals = 0;
+    }
+    if (next == current)
+        return;
 
-    // At the beginning of main(), after variable declarations
-char* port_env = std::getenv("PORT");
-if (port_env != nullptr) {
-    PORT = std::stoi(port_env);
+    pool->resize(next);
+    (next > current ? metrics.pool_grows : metrics.pool_shrinks)++;
+    metrics.worker_threads = next;
+    log("Adaptive pool: " + std::to_string(current) + " -> " + std::to_string(next) +
+        " workers (queue wait " + std::to_string(wait.count()) + " ms, busy " +
+        std::to_string(int(busy_ratio * 100)) + "%)");
 }
 
-char* max_threads_env = std::getenv("MAX_THREADS");
-if (max_threads_env != nullptr) {
-    MAX_THREADS = std::stoi(max_threads_env);
+PoolController pool_controller;
+
+// Listening socket as configured under "listeners" in config.json
+struct ListenerConfig {
+    int port = 0;
+    std::string mode = "tls";           // "tls", "plain" or "redirect"
+    int redirect_port = 0;              // redirect mode: the HTTPS port clients are sent to
+    std::string address = "0.0.0.0";    // IPv4 or IPv6 address to bind, in canonical text form
+    std::string path;                   // set for a Unix domain socket listener (port is unused)
+    bool ipv6_only = false;             // for "::", whether IPv4 clients are refused
+    bool proxy_protocol = false;        // connections start with a PROXY protocol v1/v2 header
+    std::vector<std::string> proxy_protocol_trusted;   // address blocks allowed to send one
+    // Socket options of TCP listeners
+    int tcp_defer_accept = 0;   // seconds accept() waits for a connection's first bytes
+    int tcp_fastopen = 0;       // pending Fast Open connections allowed; 0 turns it off
+    bool tcp_nodelay = false;   // inherited by the accepted connections
+    bool tcp_cork = false;      // see ResponseWriter::write()
+    int busy_poll_us = 0;       // SO_BUSY_POLL
+    bool reuse_port = false;    // SO_REUSEPORT, for several processes accepting on one port
+    int incoming_cpu = -1;      // SO_INCOMING_CPU: the CPU whose connections this socket prefers
+
+    bool operator==(const ListenerConfig&) const = default;
+    // The listener's address as logged and labelled in /metrics, and as matched at an upgrade
+    std::string name() const {
+        if (!path.empty())
+            return "unix:" + path;
+        if (address.find(':') != std::string::npos)
+            return "[" + address + "]:" + std::to_string(port);
+        return address + ":" + std::to_string(port);
+    }
+};
+
+// Server configuration as read from config.json (plus environment overrides). Loaded at
+// startup and again on SIGHUP or when the file changes; apply_config() compares the new
+// values to the running ones and only rebuilds what changed.
+struct ServerConfig {
+    int port;
+    std::vector<ListenerConfig> listeners;
+    int max_threads;
+    int min_threads;
+    bool adaptive_threads;
+    std::string cpu_affinity;
+    int adaptive_target_wait_ms;
+    std::string web_root;
+    size_t compression_min_size;
+    size_t compression_max_size;
+    size_t compression_cache_size;
+    std::vector<std::string> compressible_types;
+    size_t open_file_cache_size;
+    int open_file_cache_ttl_ms;
+    size_t content_cache_size;
+    size_t content_cache_max_file_size;
+    bool watch_web_root;
+    bool preload_web_root;
+    int keepalive_timeout_ms;
+    int keepalive_max_requests;
+    int handshake_timeout_ms;
+    int header_timeout_ms;
+    int body_timeout_ms;
+    int write_timeout_ms;
+    size_t accept_queue_size;
+    std::string shed_mode;
+    bool accept_queue_codel;
+    int codel_target_ms;
+    int codel_interval_ms;
+    double rate_limit_connections_per_second;
+    double rate_limit_connection_burst;
+    double rate_limit_requests_per_second;
+    double rate_limit_request_burst;
+    int rate_limit_ipv4_prefix;
+    int rate_limit_ipv6_prefix;
+    size_t rate_limit_table_size;
+    int shutdown_timeout_ms;
+    bool watch_config;
+    std::map<std::string, UpstreamConfig> upstreams;
+    std::map<std::string, std::string> proxy_routes;   // path prefix -> upstream name
+    int proxy_connect_timeout_ms;
+    int proxy_read_timeout_ms;
+    int health_check_interval_ms;
+    size_t response_cache_size;
+    size_t response_cache_max_entry_size;
+    int response_cache_lock_timeout_ms;
+    int websocket_ping_interval_ms;
+    size_t websocket_max_message_size;
+    size_t websocket_max_queued_bytes;
+    bool websocket_deflate;
+    size_t sse_max_queued_events;
+    std::string sse_slow_consumer_policy;
+    int sse_heartbeat_interval_ms;
+
+    bool operator==(const ServerConfig&) const = default;
+};
+
+// Function to read and validate the configuration; on failure `error` says why and nothing is
+// applied
+bool load_config(const std::string& path, ServerConfig& config, std::string& error) {
+    try {
+        std::ifstream config_file(path);
+        if (!config_file.is_open()) {
+            error = "Failed to open " + path;
+            return false;
+        }
+        json file;
+        config_file >> file;
+
+        config.port = file.value("port", 8080);
+        config.max_threads = file.value("max_threads", default_thread_count());
+        config.min_threads = file.value("min_threads", std::min(2, config.max_threads));
+        config.adaptive_threads = file.value("adaptive_threads", false);
+        config.cpu_affinity = file.value("cpu_affinity", "none");
+        config.adaptive_target_wait_ms = file.value("adaptive_target_wait_ms", 20);
+        config.web_root = file.value("web_root", "./www");
+        config.compression_min_size = file.value("compression_min_size", 1024);
+        config.compression_max_size = file.value("compression_max_size", 4 * 1024 * 1024);
+        config.compression_cache_size = file.value("compression_cache_size", 32 * 1024 * 1024);
+        config.open_file_cache_size = file.value("open_file_cache_size", 1024);
+        config.open_file_cache_ttl_ms = file.value("open_file_cache_ttl_ms", 1000);
+        config.content_cache_size = file.value("content_cache_size", 64 * 1024 * 1024);
+        config.content_cache_max_file_size = file.value("content_cache_max_file_size", 256 * 1024);
+        config.watch_web_root = file.value("watch_web_root", true);
+        config.preload_web_root = file.value("preload_web_root", false);
+        config.keepalive_timeout_ms = file.value("keepalive_timeout_ms", 5000);
+        config.keepalive_max_requests = file.value("keepalive_max_requests", 100);
+        config.handshake_timeout_ms = file.value("handshake_timeout_ms", 10000);
+        config.header_timeout_ms = file.value("header_timeout_ms", 10000);
+        config.body_timeout_ms = file.value("body_timeout_ms", 30000);
+        config.write_timeout_ms = file.value("write_timeout_ms", 30000);
+        config.accept_queue_size = file.value("accept_queue_size", 1024);
+        config.shed_mode = file.value("shed_mode", "503");
+        config.accept_queue_codel = file.value("accept_queue_codel", false);
+        config.codel_target_ms = file.value("codel_target_ms", 100);
+        config.codel_interval_ms = file.value("codel_interval_ms", 1000);
+        config.rate_limit_connections_per_second = file.value("rate_limit_connections_per_second", 0.0);
+        config.rate_limit_connection_burst = file.value("rate_limit_connection_burst", 20.0);
+        config.rate_limit_requests_per_second = file.value("rate_limit_requests_per_second", 0.0);
+        config.rate_limit_request_burst = file.value("rate_limit_request_burst", 100.0);
+        config.rate_limit_ipv4_prefix = file.value("rate_limit_ipv4_prefix", 32);
+        config.rate_limit_ipv6_prefix = file.value("rate_limit_ipv6_prefix", 64);
+        config.rate_limit_table_size = file.value("rate_limit_table_size", 1 << 20);
+        config.shutdown_timeout_ms = file.value("shutdown_timeout_ms", 8000);
+        config.watch_config = file.value("watch_config", true);
+        json upstream_list = file.value("upstreams", json::object());
+        for (const auto& [name, upstream] : upstream_list.items()) {
+            UpstreamConfig& entry = config.upstreams[name];
+            entry.servers = upstream.value("servers", std::vector<std::string>{});
+            entry.health_check_path = upstream.value("health_check_path", "");
+            entry.max_idle_connections = upstream.value("max_idle_connections", 32);
+        }
+        config.proxy_routes = file.value("proxy_routes", std::map<std::string, std::string>{});
+        config.proxy_connect_timeout_ms = file.value("proxy_connect_timeout_ms", 2000);
+        config.proxy_read_timeout_ms = file.value("proxy_read_timeout_ms", 30000);
+        config.health_check_interval_ms = file.value("health_check_interval_ms", 5000);
+        config.response_cache_size = file.value("response_cache_size", 32 * 1024 * 1024);
+        config.response_cache_max_entry_size = file.value("response_cache_max_entry_size", 1024 * 1024);
+        config.response_cache_lock_timeout_ms = file.value("response_cache_lock_timeout_ms", 5000);
+        config.websocket_ping_interval_ms = file.value("websocket_ping_interval_ms", 30000);
+        config.websocket_max_message_size = file.value("websocket_max_message_size", 1024 * 1024);
+        config.websocket_max_queued_bytes = file.value("websocket_max_queued_bytes", 1024 * 1024);
+        config.websocket_deflate = file.value("websocket_deflate", true);
+        config.sse_max_queued_events = file.value("sse_max_queued_events", 256);
+        config.sse_slow_consumer_policy = file.value("sse_slow_consumer_policy", "drop");
+        config.sse_heartbeat_interval_ms = file.value("sse_heartbeat_interval_ms", 15000);
+        json listener_list = file.value("listeners", json::array());
+        for (const json& entry : listener_list)
+            config.listeners.push_back({entry.value("port", 0), entry.value("mode", "tls"),
+                                        entry.value("redirect_port", 0), entry.value("address", "0.0.0.0"),
+                                        entry.value("path", ""), entry.value("ipv6_only", false),
+                                        entry.value("proxy_protocol", false),
+                                        entry.value("proxy_protocol_trusted", std::vector<std::string>{}),
+                                        entry.value("tcp_defer_accept", 0), entry.value("tcp_fastopen", 0),
+                                        entry.value("tcp_nodelay", false), entry.value("tcp_cork", false),
+                                        entry.value("busy_poll_us", 0), entry.value("reuse_port", false),
+                                        entry.value("incoming_cpu", -1)});
+        config.compressible_types = file.value("compressible_types", std::vector<std::string>{
+            "text/html", "text/css", "text/plain", "application/javascript", "application/json",
+            "image/svg+xml"});
+
+        // Environment variables override the file
+        if (const char *port_env = std::getenv("PORT"))
+            config.port = std::stoi(port_env);
+        if (const char *max_threads_env = std::getenv("MAX_THREADS"))
+            config.max_threads = std::stoi(max_threads_env);
+        if (const char *web_root_env = std::getenv("WEB_ROOT"))
+            config.web_root = web_root_env;
+
+        // Without "listeners" there is one TLS listener on "port"; redirects go to the first
+        // TCP TLS listener unless they name a port
+        if (config.listeners.empty())
+            config.listeners.emplace_back().port = config.port;
+        auto tls = std::find_if(config.listeners.begin(), config.listeners.end(), [](const ListenerConfig& listener) {
+            return listener.mode == "tls" && listener.path.empty();
+        });
+        for (ListenerConfig& listener : config.listeners)
+            if (listener.mode == "redirect" && listener.redirect_port == 0)
+                listener.redirect_port = tls != config.listeners.end() ? tls->port : 443;
+    } catch (const std::exception& e) {
+        error = e.what();
+        return false;
+    }
+
+    // Cache keys and watcher paths are built as WEB_ROOT + "/..."
+    while (config.web_root.size() > 1 && config.web_root.back() == '/')
+        config.web_root.pop_back();
+
+    std::error_code ec;
+    if (config.port < 1 || config.port > 65535)
+        error = "port must be between 1 and 65535";
+    else if (config.max_threads < 1)
+        error = "max_threads must be at least 1";
+    else if (config.cpu_affinity != "none" && config.cpu_affinity != "cpu" && config.cpu_affinity != "numa")
+        error = "cpu_affinity must be \"none\", \"cpu\" or \"numa\"";
+    else if (config.adaptive_threads && (config.min_threads < 1 || config.min_threads > config.max_threads))
+        error = "min_threads must be between 1 and max_threads";
+    else if (!fs::is_directory(config.web_root, ec))
+        error = "web_root " + config.web_root + " is not a directory";
+    else if (config.keepalive_timeout_ms <= 0 || config.handshake_timeout_ms <= 0 ||
+             config.header_timeout_ms <= 0 || config.body_timeout_ms <= 0 ||
+             config.write_timeout_ms <= 0 || config.shutdown_timeout_ms < 0)
+        error = "timeouts must be positive";
+    else if (config.keepalive_max_requests < 1)
+        error = "keepalive_max_requests must be at least 1";
+    else if (config.accept_queue_size < 1)
+        error = "accept_queue_size must be at least 1";
+    else if (config.shed_mode != "503" && config.shed_mode != "close")
+        error = "shed_mode must be \"503\" or \"close\"";
+    else if (config.codel_target_ms <= 0 || config.codel_interval_ms <= config.codel_target_ms)
+        error = "codel_interval_ms must be greater than codel_target_ms > 0";
+    else if (config.rate_limit_connections_per_second < 0 || config.rate_limit_requests_per_second < 0)
+        error = "rate limits must not be negative";
+    else if (config.rate_limit_ipv4_prefix < 0 || config.rate_limit_ipv4_prefix > 32 ||
+             config.rate_limit_ipv6_prefix < 0 || config.rate_limit_ipv6_prefix > 128)
+        error = "rate limit prefixes must be valid prefix lengths";
+    else if (config.proxy_connect_timeout_ms <= 0 || config.proxy_read_timeout_ms <= 0 ||
+             config.health_check_interval_ms <= 0)
+        error = "proxy timeouts must be positive";
+    else if (config.response_cache_lock_timeout_ms <= 0)
+        error = "response_cache_lock_timeout_ms must be positive";
+    else if (config.websocket_ping_interval_ms <= 0)
+        error = "websocket_ping_interval_ms must be positive";
+    else if (config.websocket_max_message_size < 1 || config.websocket_max_queued_bytes < 1)
+        error = "websocket_max_message_size and websocket_max_queued_bytes must be at least 1";
+    else if (config.sse_max_queued_events < 1)
+        error = "sse_max_queued_events must be at least 1";
+    else if (config.sse_slow_consumer_policy != "drop" && config.sse_slow_consumer_policy != "disconnect")
+        error = "sse_slow_consumer_policy must be \"drop\" or \"disconnect\"";
+    else if (config.sse_heartbeat_interval_ms <= 0)
+        error = "sse_heartbeat_interval_ms must be positive";
+
+    // Listeners need a valid, distinct address and a known mode. Addresses are rewritten in
+    // canonical form, so "::0" and "::" name the same listener.
+    if (error.empty() && config.listeners.size() > MAX_LISTENERS)
+        error = "at most " + std::to_string(MAX_LISTENERS) + " listeners are supported";
+    for (size_t i = 0; i < config.listeners.size() && error.empty(); i++) {
+        ListenerConfig& listener = config.listeners[i];
+        if (listener.address.size() > 2 && listener.address.front() == '[' && listener.address.back() == ']')
+            listener.address = listener.address.substr(1, listener.address.size() - 2);
+        std::string name = "listener " + listener.name();
+        unsigned char ip[16];
+        char canonical[INET6_ADDRSTRLEN];
+        bool v4 = inet_pton(AF_INET, listener.address.c_str(), ip) == 1;
+        if (listener.path.empty() && !v4 && inet_pton(AF_INET6, listener.address.c_str(), ip) != 1)
+            error = name + ": address must be an IPv4 or IPv6 address";
+        else if (listener.path.empty() && (listener.port < 1 || listener.port > 65535))
+            error = "listener ports must be between 1 and 65535";
+        else if (listener.path.size() >= sizeof(sockaddr_un::sun_path))
+            error = name + ": path must be shorter than " + std::to_string(sizeof(sockaddr_un::sun_path)) + " bytes";
+        else if (listener.mode != "tls" && listener.mode != "plain" && listener.mode != "redirect")
+            error = name + ": mode must be \"tls\", \"plain\" or \"redirect\"";
+        else if (listener.redirect_port < 0 || listener.redirect_port > 65535)
+            error = name + ": redirect_port must be between 1 and 65535";
+        bool tuned = listener.tcp_defer_accept != 0 || listener.tcp_fastopen != 0 || listener.tcp_nodelay ||
+                     listener.tcp_cork || listener.busy_poll_us != 0 || listener.reuse_port || listener.incoming_cpu != -1;
+        if (error.empty() && !listener.path.empty() && tuned)
+            error = name + ": TCP socket options do not apply to a Unix domain socket";
+        else if (error.empty() && (listener.tcp_defer_accept < 0 || listener.tcp_fastopen < 0 ||
+                                   listener.busy_poll_us < 0 || listener.incoming_cpu < -1))
+            error = name + ": socket option values must not be negative";
+        for (const std::string& range : listener.proxy_protocol_trusted)
+            if (error.empty() && !AddressRange::parse(range))
+                error = name + ": proxy_protocol_trusted entry " + range + " is not an address or address/prefix";
+        if (listener.path.empty() && error.empty())
+            listener.address = inet_ntop(v4 ? AF_INET : AF_INET6, ip, canonical, sizeof(canonical));
+        for (size_t j = 0; j < i && error.empty(); j++)
+            if (config.listeners[j].name() == listener.name())
+                error = "listener " + listener.name() + " is configured twice";
+    }
+
+    // Every proxied prefix must name an upstream, and every upstream needs "host:port" servers
+    for (const auto& [prefix, name] : config.proxy_routes) {
+        if (!error.empty())
+            break;
+        if (!prefix.starts_with('/'))
+            error = "proxy route " + prefix + " must start with /";
+        else if (!config.upstreams.contains(name))
+            error = "proxy route " + prefix + " names unknown upstream " + name;
+    }
+    for (const auto& [name, upstream] : config.upstreams) {
+        if (error.empty() && (upstream.servers.empty() || upstream.max_idle_connections < 0))
+            error = "upstream " + name + " needs servers and a non-negative max_idle_connections";
+        for (const std::string& server : upstream.servers) {
+            size_t colon = server.rfind(':');
+            int port = 0;
+            if (error.empty() && (colon == std::string::npos || colon == 0 ||
+                                  std::from_chars(server.data() + colon + 1, server.data() + server.size(), port).ec !=
+                                      std::errc() || port < 1 || port > 65535))
+                error = "upstream server " + server + " must be host:port";
+        }
+    }
+    return error.empty();
 }
 
-char* web_root_env = std::getenv("WEB_ROOT");
-if (web_root_env != nullptr) {
-    WEB_ROOT = web_root_env;
+// Function to build the CoDel state a configuration asks for
+std::optional<CoDel> codel_for(const ServerConfig& config) {
+    if (!config.accept_queue_codel)
+        return std::nullopt;
+    return CoDel(std::chrono::milliseconds(config.codel_target_ms),
+                 std::chrono::milliseconds(config.codel_interval_ms));
 }
 
+// Function to make a configuration the running one. `previous` is null at startup; on reload
+// only caches, threads and tables whose settings changed are touched.
+void apply_config(const ServerConfig& next, const ServerConfig *previous, ThreadPool *pool) {
+    auto changed = [&](auto field) { return !previous || next.*field != previous->*field; };
 
-    // Initialize OpenSSL
-    SSL_library_init();
-    SSL_load_error_strings();
-    OpenSSL_add_all_algorithms();
+    PORT = next.port;
+    MAX_THREADS = next.max_threads;
+    MIN_THREADS = next.min_threads;
+    ADAPTIVE_THREADS = next.adaptive_threads;
+    ADAPTIVE_TARGET_WAIT_MS = next.adaptive_target_wait_ms;
+    COMPRESSION_MIN_SIZE = next.compression_min_size;
+    COMPRESSION_MAX_SIZE = next.compression_max_size;
+    COMPRESSION_CACHE_SIZE = next.compression_cache_size;
+    OPEN_FILE_CACHE_SIZE = next.open_file_cache_size;
+    OPEN_FILE_CACHE_TTL_MS = next.open_file_cache_ttl_ms;
+    CONTENT_CACHE_SIZE = next.content_cache_size;
+    CONTENT_CACHE_MAX_FILE_SIZE = next.content_cache_max_file_size;
+    WATCH_WEB_ROOT = next.watch_web_root;
+    PRELOAD_WEB_ROOT = next.preload_web_root;
+    KEEPALIVE_TIMEOUT_MS = next.keepalive_timeout_ms;
+    KEEPALIVE_MAX_REQUESTS = next.keepalive_max_requests;
+    HANDSHAKE_TIMEOUT_MS = next.handshake_timeout_ms;
+    HEADER_TIMEOUT_MS = next.header_timeout_ms;
+    BODY_TIMEOUT_MS = next.body_timeout_ms;
+    WRITE_TIMEOUT_MS = next.write_timeout_ms;
+    ACCEPT_QUEUE_SIZE = next.accept_queue_size;
+    ACCEPT_QUEUE_CODEL = next.accept_queue_codel;
+    CODEL_TARGET_MS = next.codel_target_ms;
+    CODEL_INTERVAL_MS = next.codel_interval_ms;
+    RATE_LIMIT_CONNECTIONS_PER_SECOND = next.rate_limit_connections_per_second;
+    RATE_LIMIT_CONNECTION_BURST = next.rate_limit_connection_burst;
+    RATE_LIMIT_REQUESTS_PER_SECOND = next.rate_limit_requests_per_second;
+    RATE_LIMIT_REQUEST_BURST = next.rate_limit_request_burst;
+    RATE_LIMIT_IPV4_PREFIX = next.rate_limit_ipv4_prefix;
+    RATE_LIMIT_IPV6_PREFIX = next.rate_limit_ipv6_prefix;
+    RATE_LIMIT_TABLE_SIZE = next.rate_limit_table_size;
+    SHUTDOWN_TIMEOUT_MS = next.shutdown_timeout_ms;
+    WATCH_CONFIG = next.watch_config;
+    PROXY_CONNECT_TIMEOUT_MS = next.proxy_connect_timeout_ms;
+    PROXY_READ_TIMEOUT_MS = next.proxy_read_timeout_ms;
+    HEALTH_CHECK_INTERVAL_MS = next.health_check_interval_ms;
+    RESPONSE_CACHE_SIZE = next.response_cache_size;
+    RESPONSE_CACHE_MAX_ENTRY_SIZE = next.response_cache_max_entry_size;
+    RESPONSE_CACHE_LOCK_TIMEOUT_MS = next.response_cache_lock_timeout_ms;
+    WEBSOCKET_PING_INTERVAL_MS = next.websocket_ping_interval_ms;
+    WEBSOCKET_MAX_MESSAGE_SIZE = next.websocket_max_message_size;
+    WEBSOCKET_MAX_QUEUED_BYTES = next.websocket_max_queued_bytes;
+    WEBSOCKET_DEFLATE = next.websocket_deflate;
+    SSE_MAX_QUEUED_EVENTS = next.sse_max_queued_events;
+    SSE_HEARTBEAT_INTERVAL_MS = next.sse_heartbeat_interval_ms;
+    if (changed(&ServerConfig::web_root))
+        WEB_ROOT.set(next.web_root);
+    if (changed(&ServerConfig::compressible_types))
+        COMPRESSIBLE_TYPES.set(next.compressible_types);
+    if (changed(&ServerConfig::shed_mode))
+        SHED_MODE.set(next.shed_mode);
+    if (changed(&ServerConfig::cpu_affinity))
+        CPU_AFFINITY.set(next.cpu_affinity);
+    if (changed(&ServerConfig::sse_slow_consumer_policy))
+        SSE_SLOW_CONSUMER_POLICY.set(next.sse_slow_consumer_policy);
 
-    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
-    if (!ctx) {
-        log("Unable to create SSL context");
-        ERR_print_errors_fp(stderr);
-        return -1;
+    // Upstream pools are built once; their connections and health live on the event loop
+    if (!previous) {
+        for (const auto& [name, upstream] : next.upstreams)
+            upstreams[name] = std::make_unique<Upstream>(name, upstream);
+        for (const auto& [prefix, name] : next.proxy_routes)
+            proxy_routes.emplace_back(prefix, upstreams[name].get());
+        std::sort(proxy_routes.begin(), proxy_routes.end(),
+                  [](const auto& a, const auto& b) { return a.first.size() > b.first.size(); });
     }
 
-    // Load certificates
-    if (SSL_CTX_use_certificate_file(ctx, "server.crt", SSL_FILETYPE_PEM) <= 0 ||
-        SSL_CTX_use_PrivateKey_file(ctx, "server.key", SSL_FILETYPE_PEM) <= 0) {
-        ERR_print_errors_fp(stderr);
-        return -1;
+    // Caches keep their contents unless their own budget changed
+    if (changed(&ServerConfig::compression_cache_size))
+        variant_cache.set_capacity(COMPRESSION_CACHE_SIZE);
+    if (changed(&ServerConfig::open_file_cache_size) || changed(&ServerConfig::open_file_cache_ttl_ms))
+        open_file_cache.configure(OPEN_FILE_CACHE_SIZE, std::chrono::milliseconds(OPEN_FILE_CACHE_TTL_MS));
+    if (changed(&ServerConfig::content_cache_size))
+        content_cache.set_capacity(CONTENT_CACHE_SIZE);
+    if (changed(&ServerConfig::response_cache_size) || changed(&ServerConfig::response_cache_max_entry_size))
+        response_cache.configure(RESPONSE_CACHE_SIZE, RESPONSE_CACHE_MAX_ENTRY_SIZE);
+    if (changed(&ServerConfig::rate_limit_connections_per_second) ||
+        changed(&ServerConfig::rate_limit_connection_burst) ||
+        changed(&ServerConfig::rate_limit_requests_per_second) ||
+        changed(&ServerConfig::rate_limit_request_burst) ||
+        changed(&ServerConfig::rate_limit_ipv4_prefix) || changed(&ServerConfig::rate_limit_ipv6_prefix) ||
+        changed(&ServerConfig::rate_limit_table_size)) {
+        double rate_limits[] = {RATE_LIMIT_CONNECTIONS_PER_SECOND, RATE_LIMIT_REQUESTS_PER_SECOND};
+        double rate_bursts[] = {RATE_LIMIT_CONNECTION_BURST, RATE_LIMIT_REQUEST_BURST};
+        rate_limiter.configure(rate_limits, rate_bursts, RATE_LIMIT_IPV4_PREFIX, RATE_LIMIT_IPV6_PREFIX,
+                               RATE_LIMIT_TABLE_SIZE);
     }
 
-    // Initialize routes
-    initialize_routes();
+    // A new web root starts from empty caches, a fresh watch and (if enabled) a fresh preload
+    bool root_changed = changed(&ServerConfig::web_root);
+    if (previous && root_changed)
+        clear_file_caches();
+    if (previous && previous->watch_web_root && (root_changed || !next.watch_web_root))
+        web_root_watcher.stop();
+    if (next.watch_web_root && (root_changed || !previous->watch_web_root))
+        web_root_watcher.start(next.web_root);
+    if (next.preload_web_root && (root_changed || !previous->preload_web_root))
+        preload_web_root(next.web_root);
+
+    if (pool && (changed(&ServerConfig::max_threads) || changed(&ServerConfig::min_threads) ||
+                 changed(&ServerConfig::adaptive_threads))) {
+        // The controller moves an adaptive pool into its new bounds on its next decision
+        if (!next.adaptive_threads) {
+            pool->resize(MAX_THREADS);
+            log("Thread pool resized to " + std::to_string(MAX_THREADS) + " workers");
+        }
+    }
+    if (pool && (changed(&ServerConfig::accept_queue_size) || changed(&ServerConfig::accept_queue_codel) ||
+                 changed(&ServerConfig::codel_target_ms) || changed(&ServerConfig::codel_interval_ms)))
+        pool->set_admission(ACCEPT_QUEUE_SIZE, codel_for(next));
+    if (previous && changed(&ServerConfig::listeners))
+        log("New listeners take effect after a restart or binary upgrade (SIGUSR2)");
+    if (previous && (changed(&ServerConfig::upstreams) || changed(&ServerConfig::proxy_routes)))
+        log("New upstreams and proxy_routes take effect after a restart or binary upgrade (SIGUSR2)");
+    if (previous && changed(&ServerConfig::cpu_affinity))
+        log("New cpu_affinity applies to workers started from now on");
+}
+
+// Function to get the name (as ListenerConfig::name() spells it) of the address a listening
+// socket is bound to; empty if it cannot be read
+std::string bound_name(int fd) {
+    sockaddr_storage addr{};
+    socklen_t length = sizeof(addr);
+    if (getsockname(fd, (sockaddr*)&addr, &length) < 0)
+        return "";
+    ListenerConfig bound;
+    char text[INET6_ADDRSTRLEN];
+    if (addr.ss_family == AF_UNIX) {
+        const auto& un = reinterpret_cast<const sockaddr_un&>(addr);
+        bound.path = std::string(un.sun_path, strnlen(un.sun_path, length - offsetof(sockaddr_un, sun_path)));
+    } else if (addr.ss_family == AF_INET) {
+        const auto& v4 = reinterpret_cast<const sockaddr_in&>(addr);
+        bound.address = inet_ntop(AF_INET, &v4.sin_addr, text, sizeof(text));
+        bound.port = ntohs(v4.sin_port);
+    } else {
+        const auto& v6 = reinterpret_cast<const sockaddr_in6&>(addr);
+        bound.address = inet_ntop(AF_INET6, &v6.sin6_addr, text, sizeof(text));
+        bound.port = ntohs(v6.sin6_port);
+    }
+    return bound.name();
+}
+
+// Function to remove a Unix socket file left behind by a server that did not shut down cleanly,
+// which would make bind() fail. A socket something still accepts on is left alone.
+void remove_stale_socket(const sockaddr_un& addr) {
+    struct stat st;
+    if (lstat(addr.sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+        return;
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0)
+        return;
+    if (connect(probe, (const sockaddr*)&addr, sizeof(addr)) < 0 && errno == ECONNREFUSED)
+        unlink(addr.sun_path);
+    close(probe);
+}
 
+// Function to apply a TCP listener's socket options; also run on sockets inherited at a binary
+// upgrade, so options the configuration dropped are turned off again. Options the kernel
+// refuses (SO_BUSY_POLL needs CAP_NET_ADMIN, for one) are logged and skipped.
+void apply_socket_options(int fd, const ListenerConfig& config) {
+    auto set = [&](int level, int option, int value, const char *name) {
+        if (setsockopt(fd, level, option, &value, sizeof(value)) < 0)
+            log(std::string("Could not set ") + name + " on " + config.name() + ": " + std::strerror(errno));
+    };
+    set(IPPROTO_TCP, TCP_DEFER_ACCEPT, config.tcp_defer_accept, "TCP_DEFER_ACCEPT");
+    set(IPPROTO_TCP, TCP_FASTOPEN, config.tcp_fastopen, "TCP_FASTOPEN");
+    set(IPPROTO_TCP, TCP_NODELAY, config.tcp_nodelay, "TCP_NODELAY");
+    if (config.busy_poll_us > 0)
+        set(SOL_SOCKET, SO_BUSY_POLL, config.busy_poll_us, "SO_BUSY_POLL");
+    if (config.incoming_cpu >= 0)
+        set(SOL_SOCKET, SO_INCOMING_CPU, config.incoming_cpu, "SO_INCOMING_CPU");
+}
+
+// Function to create, bind and listen on a listener's socket; -1 on failure. TCP listeners
+// bind the configured IPv4 or IPv6 address ("::" is dual-stack unless ipv6_only is set); Unix
+// domain socket listeners bind their path.
+int open_listener(const ListenerConfig& config) {
     int server_socket;
-    sockaddr_in server_addr{};
+    sockaddr_storage server_addr{};
+    socklen_t server_addr_len;
+
+    // Configure the server address
+    auto& un = reinterpret_cast<sockaddr_un&>(server_addr);
+    auto& v4 = reinterpret_cast<sockaddr_in&>(server_addr);
+    auto& v6 = reinterpret_cast<sockaddr_in6&>(server_addr);
+    if (!config.path.empty()) {
+        un.sun_family = AF_UNIX;
+        std::memcpy(un.sun_path, config.path.data(), config.path.size());
+        server_addr_len = sizeof(sockaddr_un);
+        remove_stale_socket(un);
+    } else if (inet_pton(AF_INET, config.address.c_str(), &v4.sin_addr) == 1) {
+        v4.sin_family = AF_INET;
+        v4.sin_port = htons(config.port);
+        server_addr_len = sizeof(sockaddr_in);
+    } else {
+        inet_pton(AF_INET6, config.address.c_str(), &v6.sin6_addr);
+        v6.sin6_family = AF_INET6;
+        v6.sin6_port = htons(config.port);
+        server_addr_len = sizeof(sockaddr_in6);
+    }
 
     // Create the server socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    server_socket = socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_socket == -1) {
         log("Failed to create socket.");
         return -1;
@@ -441,23 +6410,25 @@ if (web_root_env != nullptr) {
 
     // Set socket options
     int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    int v6_only = config.ipv6_only;
+    if ((server_addr.ss_family != AF_UNIX &&
+         setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) ||
+        (config.reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) ||
+        (server_addr.ss_family == AF_INET6 &&
+         setsockopt(server_socket, IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only)) < 0)) {
         log("setsockopt failed.");
         close(server_socket);
         return -1;
     }
 
-    // Configure the server address
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
-
     // Bind the socket
-    if (bind(server_socket, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        log("Failed to bind socket.");
+    if (bind(server_socket, (sockaddr*)&server_addr, server_addr_len) < 0) {
+        log("Failed to bind socket to " + config.name() + ": " + std::strerror(errno));
         close(server_socket);
         return -1;
     }
+    if (server_addr.ss_family != AF_UNIX)
+        apply_socket_options(server_socket, config);
 
     // Listen for incoming connections
     if (listen(server_socket, 10) < 0) {
@@ -465,26 +6436,425 @@ if (web_root_env != nullptr) {
         close(server_socket);
         return -1;
     }
+    return server_socket;
+}
 
-    log("Server is listening on port " + std::to_string(PORT));
+// Binary Upgrade: on SIGUSR2 the running server starts a fresh copy of its binary and hands it
+// the listening sockets, plus the TLS session ticket keys so tickets issued by the old process
+// stay valid, over a Unix socketpair (SCM_RIGHTS). Both processes accept from the same sockets
+// until the new one reports it is ready; the old one then drains and exits. If the new process
+// fails to start, the old one simply keeps serving.
+const char *UPGRADE_FD_ENV = "SERVER_UPGRADE_FD";
+const uint32_t UPGRADE_MAGIC = 0x53525631;  // "SRV1"
+const size_t MAX_HANDOFF_FDS = MAX_LISTENERS;
+const size_t MAX_TICKET_KEY_LENGTH = 128;
 
-    // Create a thread pool
-    ThreadPool pool(MAX_THREADS, ctx);
+struct UpgradeHeader {
+    uint32_t magic;
+    uint32_t listener_count;
+    uint32_t ticket_key_length;
+};
 
-    while (true) {
-        // Accept a new client connection
-        int client_socket = accept(server_socket, nullptr, nullptr);
-        if (client_socket < 0) {
-            log("Failed to accept client connection.");
-            continue;
+// Function to send the listening sockets and ticket keys to the new process
+bool send_handoff(int channel, const std::vector<int>& listeners, SSL_CTX *ctx) {
+    unsigned char ticket_keys[MAX_TICKET_KEY_LENGTH];
+    long key_length = SSL_CTX_get_tlsext_ticket_keys(ctx, nullptr, 0);
+    if (key_length <= 0 || key_length > long(sizeof(ticket_keys)) ||
+        SSL_CTX_get_tlsext_ticket_keys(ctx, ticket_keys, key_length) != 1)
+        key_length = 0;
+
+    UpgradeHeader header{UPGRADE_MAGIC, uint32_t(listeners.size()), uint32_t(key_length)};
+    iovec parts[] = {{&header, sizeof(header)}, {ticket_keys, size_t(key_length)}};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)] = {};
+    msghdr message{};
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * listeners.size());
+    cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * listeners.size());
+    std::memcpy(CMSG_DATA(rights), listeners.data(), sizeof(int) * listeners.size());
+    return sendmsg(channel, &message, 0) == ssize_t(sizeof(header) + key_length);
+}
+
+// Function to receive the listening sockets and ticket keys from the old process
+bool receive_handoff(int channel, std::vector<int>& listeners, std::vector<unsigned char>& ticket_keys) {
+    unsigned char buffer[sizeof(UpgradeHeader) + MAX_TICKET_KEY_LENGTH];
+    iovec part{buffer, sizeof(buffer)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+    msghdr message{};
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+
+    for (cmsghdr *c = CMSG_FIRSTHDR(&message); received > 0 && c; c = CMSG_NXTHDR(&message, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            size_t count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            listeners.resize(count);
+            std::memcpy(listeners.data(), CMSG_DATA(c), sizeof(int) * count);
+        }
+    }
+    UpgradeHeader header;
+    if (received < ssize_t(sizeof(header)))
+        return false;
+    std::memcpy(&header, buffer, sizeof(header));
+    if (header.magic != UPGRADE_MAGIC || header.listener_count != listeners.size() ||
+        header.listener_count == 0 || received != ssize_t(sizeof(header) + header.ticket_key_length))
+        return false;
+    ticket_keys.assign(buffer + sizeof(header), buffer + received);
+    return true;
+}
+
+// Function to start the new binary and hand it the listening sockets. Returns the child's pid,
+// with `channel` set to the end of the socketpair its readiness will be reported on, or -1.
+pid_t start_upgrade(char *argv[], const std::vector<int>& listeners, SSL_CTX *ctx, int& channel) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0)
+        return -1;
+
+    // Everything the child needs is prepared up front: only async-signal-safe calls after fork()
+    std::vector<std::string> environment;
+    for (char **entry = environ; *entry; entry++) {
+        if (!std::string_view(*entry).starts_with(UPGRADE_FD_ENV))
+            environment.emplace_back(*entry);
+    }
+    environment.push_back(std::string(UPGRADE_FD_ENV) + "=3");
+    std::vector<char*> envp;
+    for (std::string& entry : environment)
+        envp.push_back(entry.data());
+    envp.push_back(nullptr);
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    int max_fd = limit.rlim_cur == RLIM_INFINITY ? 65536 : int(limit.rlim_cur);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: the channel becomes fd 3, every other inherited descriptor is closed
+        if (pair[1] == 3)
+            fcntl(3, F_SETFD, 0);
+        else
+            dup2(pair[1], 3);
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, 4, ~0U, 0) != 0)
+#endif
+            for (int fd = 4; fd < max_fd; fd++)
+                close(fd);
+        execve(argv[0], argv, envp.data());
+        _exit(127);
+    }
+    close(pair[1]);
+    if (pid < 0 || !send_handoff(pair[0], listeners, ctx)) {
+        // Without its sockets the child exits on its own as soon as it sees the channel close
+        close(pair[0]);
+        if (pid > 0)
+            waitpid(pid, nullptr, 0);
+        return -1;
+    }
+    channel = pair[0];
+    return pid;
+}
+
+int main(int, char *argv[]) {
+    // Open log file
+    log_file.open("server.log", std::ios::app);
+    if (!log_file.is_open()) {
+        std::cerr << "Failed to open log file." << std::endl;
+        return -1;
+    }
+
+    // Stop signals are picked up by the accept loop through a signalfd, so block them in every
+    // thread (threads inherit the mask, hence before any is started)
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGUSR2);
+    sigaddset(&stop_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+    int signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        log("Failed to create signalfd");
+        return -1;
+    }
+
+    // When started by a binary upgrade, take over the old process's listening sockets
+    std::vector<int> inherited_listeners;
+    std::vector<unsigned char> inherited_ticket_keys;
+    int upgrade_channel = -1;
+    if (const char *upgrade_fd = std::getenv(UPGRADE_FD_ENV)) {
+        upgrade_channel = std::atoi(upgrade_fd);
+        unsetenv(UPGRADE_FD_ENV);
+        fcntl(upgrade_channel, F_SETFD, FD_CLOEXEC);
+        if (!receive_handoff(upgrade_channel, inherited_listeners, inherited_ticket_keys)) {
+            log("Failed to receive listening sockets from the previous process");
+            return -1;
+        }
+    }
+
+    // Read configuration file
+    ServerConfig config;
+    std::string config_error;
+    if (!load_config("config.json", config, config_error)) {
+        log("Invalid configuration: " + config_error);
+        return -1;
+    }
+    apply_config(config, nullptr, nullptr);
+
+    // Initialize OpenSSL
+    SSL_library_init();
+    SSL_load_error_strings();
+    OpenSSL_add_all_algorithms();
+
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        log("Unable to create SSL context");
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    // Let OpenSSL free its per-connection record buffers while a connection is idle
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+    if (!inherited_ticket_keys.empty() &&
+        SSL_CTX_set_tlsext_ticket_keys(ctx, inherited_ticket_keys.data(), inherited_ticket_keys.size()) != 1)
+        log("Could not reuse the previous process's session ticket keys");
+
+    // Load certificates (a server with only plaintext listeners needs none)
+    bool serves_tls = std::any_of(config.listeners.begin(), config.listeners.end(),
+                                  [](const ListenerConfig& listener) { return listener.mode == "tls"; });
+    if (serves_tls && (SSL_CTX_use_certificate_file(ctx, "server.crt", SSL_FILETYPE_PEM) <= 0 ||
+                       SSL_CTX_use_PrivateKey_file(ctx, "server.key", SSL_FILETYPE_PEM) <= 0)) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    // Initialize routes
+    initialize_routes();
+
+    // Open the configured listeners, taking over the previous process's socket for any address
+    // it was already listening on; inherited sockets the configuration no longer lists are closed
+    for (const ListenerConfig& entry : config.listeners) {
+        Listener& listener = listeners.emplace_back();
+        listener.mode = entry.mode == "plain" ? Listener::PLAIN
+                      : entry.mode == "redirect" ? Listener::REDIRECT : Listener::TLS;
+        listener.name = entry.name();
+        listener.path = entry.path;
+        listener.redirect_port = entry.redirect_port;
+        listener.ctx = listener.mode == Listener::TLS ? ctx : nullptr;
+        listener.proxy_protocol = entry.proxy_protocol;
+        for (const std::string& range : entry.proxy_protocol_trusted)
+            listener.proxy_trusted.push_back(*AddressRange::parse(range));
+        auto inherited = std::find_if(inherited_listeners.begin(), inherited_listeners.end(),
+                                      [&](int fd) { return bound_name(fd) == listener.name; });
+        bool took_over = inherited != inherited_listeners.end();
+        listener.tcp_cork = entry.tcp_cork;
+        listener.tcp_fastopen = entry.tcp_fastopen > 0;
+        if (took_over) {
+            listener.fd = *inherited;
+            inherited_listeners.erase(inherited);
+            if (entry.path.empty())
+                apply_socket_options(listener.fd, entry);
+        } else if ((listener.fd = open_listener(entry)) < 0) {
+            return -1;
+        }
+        log("Server is listening on " + listener.name + " (" + Listener::MODE_NAMES[listener.mode] +
+            (took_over ? ", taken over from the previous process)" : ")"));
+    }
+    for (int fd : inherited_listeners) {
+        std::string name = bound_name(fd);
+        if (name.starts_with("unix:"))
+            unlink(name.c_str() + 5);
+        close(fd);
+    }
+    const CpuTopology& topology = cpu_topology();
+    log("Usable CPUs: " + std::to_string(topology.cpus.size()) + " on " + std::to_string(topology.nodes.size()) +
+        " NUMA node(s), cgroup quota " + (topology.quota > 0 ? std::to_string(topology.quota) : "unlimited") +
+        ", cpu_affinity " + *CPU_AFFINITY.get());
+
+    // Writes to a client that went away (or whose deadline shut its socket) must fail with
+    // EPIPE instead of killing the process
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // Start expiring connection deadlines, then create a thread pool
+    timeout_reaper.start();
+    load_shedder.start();
+
+    // Edits of config.json are picked up through its directory, as editors replace the file
+    int config_watch_fd = -1;
+    if (WATCH_CONFIG) {
+        config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (config_watch_fd >= 0 && inotify_add_watch(config_watch_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            close(config_watch_fd);
+            config_watch_fd = -1;
+        }
+    }
+
+    {
+        ThreadPool pool(ADAPTIVE_THREADS ? MIN_THREADS : MAX_THREADS, ACCEPT_QUEUE_SIZE, codel_for(config));
+        pool_controller.start(&pool);
+        event_loop.start(&pool);
+        for (const auto& [name, upstream] : upstreams)
+            event_loop.spawn(upstream->check_health(), true);
+
+        // Function to re-read config.json and apply whatever changed
+        auto reload_config = [&]() {
+            ServerConfig next;
+            std::string error;
+            if (!load_config("config.json", next, error)) {
+                metrics.config_reload_failures++;
+                log("Config reload failed, keeping the current configuration: " + error);
+                return;
+            }
+            if (next == config)
+                return;
+            apply_config(next, &config, &pool);
+            config = next;
+            metrics.config_reloads++;
+            log("Configuration reloaded");
+        };
+
+        // Tell the process we took over from that we are accepting now
+        if (upgrade_channel >= 0) {
+            char ready = 'R';
+            if (write(upgrade_channel, &ready, 1) != 1)
+                log("Failed to report readiness to the previous process");
+            close(upgrade_channel);
+        }
+
+        pid_t upgrade_pid = -1;
+        int upgrade_ready_fd = -1;
+        std::vector<int> listener_fds;
+        for (const Listener& listener : listeners)
+            listener_fds.push_back(listener.fd);
+        // The signalfd, upgrade channel and config watch come first, one entry per listener after
+        const size_t FIRST_LISTENER = 3;
+        std::vector<pollfd> fds(FIRST_LISTENER + listeners.size());
+        bool handed_off = false;
+        while (true) {
+            // Wait for a new client connection, a signal, or word from an upgraded process
+            fds[0] = {signal_fd, POLLIN, 0};
+            fds[1] = {upgrade_ready_fd, POLLIN, 0};
+            fds[2] = {config_watch_fd, POLLIN, 0};
+            for (size_t i = 0; i < listeners.size(); i++)
+                fds[FIRST_LISTENER + i] = {listeners[i].fd, POLLIN, 0};
+            if (poll(fds.data(), fds.size(), -1) < 0)
+                continue;
+            if (fds[2].revents & POLLIN) {
+                alignas(inotify_event) char events[4096];
+                ssize_t length = read(config_watch_fd, events, sizeof(events));
+                bool touched = false;
+                for (ssize_t offset = 0; offset < length;) {
+                    const auto *event = reinterpret_cast<const inotify_event*>(events + offset);
+                    if (event->len > 0 && std::strcmp(event->name, "config.json") == 0)
+                        touched = true;
+                    offset += sizeof(inotify_event) + event->len;
+                }
+                if (touched)
+                    reload_config();
+            }
+            if (fds[0].revents & POLLIN) {
+                signalfd_siginfo info;
+                if (read(signal_fd, &info, sizeof(info)) != sizeof(info))
+                    continue;
+                if (info.ssi_signo == SIGHUP) {
+                    reload_config();
+                    continue;
+                }
+                if (info.ssi_signo != SIGUSR2) {
+                    log(std::string("Received ") + strsignal(info.ssi_signo) + ", shutting down");
+                    break;
+                }
+                if (upgrade_pid > 0) {
+                    log("Binary upgrade already in progress");
+                } else if ((upgrade_pid = start_upgrade(argv, listener_fds, ctx, upgrade_ready_fd)) < 0) {
+                    log("Failed to start the new binary");
+                } else {
+                    log("Started new binary (pid " + std::to_string(upgrade_pid) + ")");
+                }
+            }
+            if (fds[1].revents) {
+                char ready = 0;
+                bool took_over = read(upgrade_ready_fd, &ready, 1) == 1 && ready == 'R';
+                close(upgrade_ready_fd);
+                upgrade_ready_fd = -1;
+                if (took_over) {
+                    log("New binary is accepting connections, shutting down");
+                    handed_off = true;
+                    break;
+                }
+                log("New binary failed to start, still serving");
+                waitpid(upgrade_pid, nullptr, 0);
+                upgrade_pid = -1;
+            }
+            for (size_t i = 0; i < listeners.size(); i++) {
+                if (!(fds[FIRST_LISTENER + i].revents & POLLIN))
+                    continue;
+                Listener& listener = listeners[i];
+
+                // Accept a new client connection
+                sockaddr_storage client_addr{};
+                socklen_t client_addr_len = sizeof(client_addr);
+                int client_socket = accept(listener.fd, (sockaddr*)&client_addr, &client_addr_len);
+                if (client_socket < 0) {
+                    log("Failed to accept client connection.");
+                    continue;
+                }
+                listener.accepted++;
+                if (listener.tcp_fastopen) {
+                    tcp_info info{};
+                    socklen_t info_len = sizeof(info);
+                    if (getsockopt(client_socket, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0 &&
+                        (info.tcpi_options & TCPI_OPT_SYN_DATA))
+                        metrics.tcp_fastopen_connections++;
+                }
+                PeerAddress peer = PeerAddress::from(client_addr);
+
+                // Clients over their connection rate are dropped before any TLS work. Behind a
+                // PROXY protocol balancer the peer is the balancer, so that waits for the header.
+                if (!listener.proxy_protocol && !rate_limiter.allow(peer, RateLimiter::CONNECTIONS)) {
+                    close(client_socket);
+                    continue;
+                }
+
+                // Enqueue the client socket to the thread pool, or turn it away if the queue is full
+                if (!pool.enqueue(client_socket, peer, &listener))
+                    shed_connection(client_socket, SHED_QUEUE_FULL, &listener);
+            }
         }
 
-        // Enqueue the client socket to the thread pool
-        pool.enqueue(client_socket);
+        // Graceful shutdown: stop accepting, close idle keep-alive connections, and let queued and
+        // in-flight requests finish (their responses carry "Connection: close") until the deadline
+        // Unix socket files are removed, unless the new binary now accepts on them
+        for (const Listener& listener : listeners) {
+            close(listener.fd);
+            if (!listener.path.empty() && !handed_off)
+                unlink(listener.path.c_str());
+        }
+        pool_controller.stop();
+        draining = true;
+        timeout_reaper.expire_all(true);
+        event_loop.spawn(close_websockets(), true);
+        event_loop.spawn(close_event_streams(), true);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(SHUTDOWN_TIMEOUT_MS);
+        if (!pool.drain(deadline)) {
+            log("Shutdown deadline reached, closing remaining connections");
+            abort_connections = true;
+            timeout_reaper.expire_all(false);
+        }
+        event_loop.stop();
     }
 
-    // Close the server socket (unreachable code in this example)
-    close(server_socket);
+    load_shedder.stop();
+    web_root_watcher.stop();
+    timeout_reaper.stop();
+    close(signal_fd);
+    if (config_watch_fd >= 0)
+        close(config_watch_fd);
+
+    // Flush the final counters to the log
+    log("Final metrics:\n" + render_metrics());
 
     // Close log file
     log_file.close();